@@ -0,0 +1,141 @@
+#!/bin/sh
+# Usage: ./bench.sh [xin binary] [output file]
+#
+# Runs synthetic input streams through xin on a private Xvfb with each
+# injection method and writes the throughput, CPU time per event and
+# system calls per event as JSON. System calls are counted in a second
+# run under strace(1) if it is installed, and are null otherwise.
+#
+# BENCH_EVENTS sets the stream length and BENCH_DISPLAY the display
+# used for Xvfb.
+#
+# BENCH_UINPUT=1 adds the uinput method. Xvfb does not read input
+# devices, so only our side of it is measured, and the events go to the
+# console and any other X server on this machine; run it where nobody
+# is logged in.
+
+XIN=${1:-./xin}
+OUT=${2:-bench.json}
+EVENTS=${BENCH_EVENTS:-200000}
+BDISPLAY=${BENCH_DISPLAY:-:99}
+
+STREAMS="motion typing mixed layout"
+METHODS="xtest sendevent xcb"
+if [ "${BENCH_UINPUT}" = 1 ] ; then METHODS="${METHODS} uinput" ; fi
+
+if [ ! -x "${XIN}" ] ; then
+	echo "${XIN}: not found; run make first" >&2
+	exit 1
+fi
+if ! command -v Xvfb >/dev/null ; then
+	echo "You need to have Xvfb." >&2
+	exit 1
+fi
+
+TMP=$(mktemp -d) || exit 1
+XVFB_PID=
+cleanup() {
+	if [ -n "${XVFB_PID}" ] ; then kill ${XVFB_PID} 2>/dev/null ; fi
+	rm -rf "${TMP}"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM HUP
+
+Xvfb ${BDISPLAY} -nolisten tcp -screen 0 1920x1080x24 \
+    >"${TMP}/xvfb.log" 2>&1 &
+XVFB_PID=$!
+DISPLAY=${BDISPLAY}
+export DISPLAY
+i=0
+until xdpyinfo >/dev/null 2>&1 || [ -e "/tmp/.X11-unix/X${BDISPLAY#:}" ] ; do
+	i=$((i + 1))
+	if [ ${i} -gt 50 ] || ! kill -0 ${XVFB_PID} 2>/dev/null ; then
+		echo "Xvfb did not start:" >&2
+		cat "${TMP}/xvfb.log" >&2
+		exit 1
+	fi
+	sleep 0.1
+done
+
+# Writes a stream of the given kind with about EVENTS events.
+generate() {
+	awk -v n="${EVENTS}" -v kind="$1" 'BEGIN {
+		srand(1);
+		for (i = 0; i < n; ) {
+			if (kind == "motion" ||
+			    (kind == "mixed" && i % 10 < 6)) {
+				printf("m %d %d\n", int(rand() * 11) - 5,
+				    int(rand() * 11) - 5);
+				i++;
+			} else if (kind == "mixed" && i % 10 < 8) {
+				printf("b 0 1\nB 0 1\n");
+				i += 2;
+			} else {
+				if (kind == "layout" && i % 50 == 0)
+					printf("l %s\n", (i / 50) % 2 ? "fi" : "us");
+				k = 97 + int(rand() * 26);
+				printf("k %d\nK %d\n", k, k);
+				i += 2;
+			}
+		}
+	}'
+}
+
+flags() {
+	case $1 in
+	xtest)		echo "-m xtest" ;;
+	sendevent)	echo "-s" ;;
+	xcb)		echo "-m xcb" ;;
+	uinput)		echo "-m uinput" ;;
+	esac
+}
+
+VERSION=$(git describe --always --dirty 2>/dev/null || echo unknown)
+{
+	printf '{\n  "version": "%s",\n' "${VERSION}"
+	printf '  "date": "%s",\n' "$(date -u +%Y-%m-%dT%H:%M:%SZ)"
+	printf '  "events": %s,\n  "results": [' "${EVENTS}"
+} >"${OUT}"
+
+sep=
+for stream in ${STREAMS} ; do
+	generate ${stream} >"${TMP}/${stream}"
+	for method in ${METHODS} ; do
+		opts="-v $(flags ${method})"
+		if [ ${stream} = layout ] ; then opts="${opts} -L us,fi" ; fi
+
+		# shellcheck disable=SC2086
+		"${XIN}" ${opts} <"${TMP}/${stream}" 2>"${TMP}/log"
+		line=$(grep ' events in .* events/s; cpu ' "${TMP}/log")
+		if [ -z "${line}" ] ; then
+			echo "${stream}/${method}: xin failed:" >&2
+			cat "${TMP}/log" >&2
+			exit 1
+		fi
+		set -- $(echo "${line}" | sed -e 's/^[^:]*: //' \
+		    -e 's/[^0-9. ]//g')
+		events=$1 secs=$2 rate=$3 cpu=$6
+
+		syscalls=null
+		if command -v strace >/dev/null ; then
+			# shellcheck disable=SC2086
+			strace -f -c -o "${TMP}/strace" "${XIN}" \
+			    $(flags ${method}) <"${TMP}/${stream}" 2>/dev/null
+			syscalls=$(awk -v n="${events}" '$NF == "total" {
+				printf("%.3f", $4 / n) }' "${TMP}/strace")
+			[ -n "${syscalls}" ] || syscalls=null
+		fi
+
+		printf '%s: %s events/s, %s us cpu/event, %s syscalls/event\n' \
+		    "${stream}/${method}" ${rate} ${cpu} ${syscalls}
+		printf '%s\n    {"stream": "%s", "method": "%s", "events": %s, ' \
+		    "${sep}" ${stream} ${method} ${events} >>"${OUT}"
+		printf '"seconds": %s, "events_per_sec": %s, ' \
+		    ${secs} ${rate} >>"${OUT}"
+		printf '"cpu_us_per_event": %s, "syscalls_per_event": %s}' \
+		    ${cpu} ${syscalls} >>"${OUT}"
+		sep=,
+	done
+done
+printf '\n  ]\n}\n' >>"${OUT}"
+echo "results written to ${OUT}"
@@ -0,0 +1,292 @@
+/*
+ * xin - X11 forwarded input receiver
+ * Copyright (c) 2020 Tommi Leino <namhas@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Injection to several displays at once.
+ *
+ * The input is read and parsed once by the main thread and copied to a
+ * ring per display. Each display has a worker thread with a connection,
+ * keysym cache, layout state and flush policy of its own, running the
+ * same injection loop as a single display does.
+ *
+ * With -t, the input multiplexes several targets instead, and each event
+ * goes only to the worker of its target. A target is a display and
+ * optionally an XI2 master device, which becomes the client pointer of
+ * the worker's connection; the server then sends the core events faked
+ * through XTEST to that master and its paired keyboard. As every target
+ * has one ring and one thread, the events of a target stay in order
+ * while the targets are injected in parallel.
+ *
+ * When a worker does not make room in its ring within the lag bound,
+ * its input is skipped until it has injected everything it was given,
+ * instead of holding back the others. It then releases the keys and
+ * buttons it holds down, because their releases may have been skipped.
+ */
+
+#include "xin.h"
+
+#include <X11/extensions/XInput2.h>
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void	*fanout_worker(void *);
+static void	 fanout_seat(struct worker *, const char *);
+static void	 fanout_route(struct fanout *, struct event *, size_t,
+		    const struct timespec *);
+static struct worker *fanout_find(struct fanout *, int);
+static void	 fanout_push(struct fanout *, struct worker *, struct event *,
+		    size_t, const struct timespec *);
+
+/*
+ * Opens a worker for every target. With route set, the events are
+ * routed by their target id, and otherwise every worker gets them all.
+ */
+void
+fanout_init(struct fanout *fo, struct target *t, int n, int route,
+    long lag, const struct options *opt)
+{
+	struct worker *w;
+	int i;
+
+	if ((fo->w = calloc(n, sizeof(*fo->w))) == NULL)
+		err(1, "calloc");
+	fo->n = n;
+	fo->route = route;
+	fo->last = 0;
+	fo->lag = lag;
+	for (i = 0; i < n; i++) {
+		w = &fo->w[i];
+		w->target = t[i].id;
+		if (route && fanout_find(fo, t[i].id) != w)
+			errx(1, "target %d given twice", t[i].id);
+		if (route)
+			snprintf(w->name, sizeof(w->name), "target %d",
+			    t[i].id);
+		else
+			snprintf(w->name, sizeof(w->name), "%s",
+			    XDisplayName(t[i].display));
+		injector_open(&w->inj, t[i].display, opt);
+		if (t[i].device != NULL)
+			fanout_seat(w, t[i].device);
+		ring_init(&w->ring);
+	}
+}
+
+/*
+ * Reads the input and hands it to the workers until the end of input.
+ */
+void
+fanout_run(struct fanout *fo, struct reader *rd)
+{
+	struct event ev[FANOUT_BATCH];
+	struct timespec stamp;
+	struct pollfd pfd;
+	size_t n;
+	int i, nread;
+
+	for (i = 0; i < fo->n; i++)
+		thread_start(&fo->w[i].thread, fanout_worker, &fo->w[i]);
+
+	nread = -1;
+	pfd.fd = rd->fd;
+	pfd.events = POLLIN;
+	do {
+		if (poll(&pfd, 1, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+		nread = reader_fill(rd);
+		clock_gettime(CLOCK_MONOTONIC, &stamp);
+		while ((n = reader_parse(rd, ev,
+		    sizeof(ev) / sizeof(ev[0]))) > 0) {
+			if (fo->route) {
+				fanout_route(fo, ev, n, &stamp);
+				continue;
+			}
+			for (i = 0; i < fo->n; i++)
+				fanout_push(fo, &fo->w[i], ev, n, &stamp);
+		}
+	} while (nread != 0);
+
+	for (i = 0; i < fo->n; i++)
+		ring_close(&fo->w[i].ring);
+	for (i = 0; i < fo->n; i++)
+		pthread_join(fo->w[i].thread, NULL);
+}
+
+void
+fanout_stats(struct fanout *fo)
+{
+	struct worker *w;
+	unsigned long long events;
+	int i, t;
+
+	for (i = 0; i < fo->n; i++) {
+		w = &fo->w[i];
+		for (events = 0, t = 0; t < NTYPES; t++)
+			events += w->inj.events[t];
+		warnx("%s: %llu events, %llu skipped, %llu times behind; "
+		    "%llu requests in %llu flushes", w->name, events,
+		    w->dropped, w->lags, w->inj.flush.requests,
+		    w->inj.flush.flushes);
+	}
+	if (fo->unrouted > 0)
+		warnx("%llu events for unknown targets", fo->unrouted);
+}
+
+/*
+ * The replay jitter of each display, which is reported even without -v.
+ */
+void
+fanout_replay_stats(struct fanout *fo)
+{
+	int i;
+
+	for (i = 0; i < fo->n; i++)
+		replay_stats(&fo->w[i].inj.replay, fo->w[i].name);
+}
+
+static void *
+fanout_worker(void *arg)
+{
+	struct worker *w = arg;
+
+	injector_run(&w->inj, NULL, &w->ring, NULL);
+	injector_finish(&w->inj);
+	return NULL;
+}
+
+/*
+ * Makes the XI2 master device given by name or id, or the master
+ * pointer paired with it if it is a keyboard, the client pointer of
+ * the worker's connection.
+ */
+static void
+fanout_seat(struct worker *w, const char *device)
+{
+	Display *dpy = w->inj.dpy;
+	XIDeviceInfo *info;
+	char *end;
+	long id;
+	int i, n, major, minor, opcode, event, error;
+
+	if (XQueryExtension(dpy, "XInputExtension", &opcode, &event,
+	    &error) == False)
+		errx(1, "%s: XInput extension not available", w->name);
+	major = XI_MAJOR;
+	minor = XI_MINOR;
+	if (XIQueryVersion(dpy, &major, &minor) != Success)
+		errx(1, "%s: XInput 2 not available", w->name);
+
+	id = strtol(device, &end, 10);
+	if (end == device || *end != '\0')
+		id = -1;
+	if ((info = XIQueryDevice(dpy, XIAllMasterDevices, &n)) == NULL)
+		errx(1, "%s: couldn't query input devices", w->name);
+	for (i = 0; i < n; i++)
+		if (info[i].deviceid == id || strcmp(info[i].name, device) == 0)
+			break;
+	if (i == n)
+		errx(1, "%s: no master device '%s'", w->name, device);
+	id = info[i].use == XIMasterKeyboard ? info[i].attachment :
+	    info[i].deviceid;
+	XIFreeDeviceInfo(info);
+
+	if (XISetClientPointer(dpy, None, id) != Success)
+		errx(1, "%s: couldn't set the client pointer", w->name);
+	pointer_devices(&w->inj.ptr);
+}
+
+/*
+ * Splits the events by target and hands each worker its share.
+ */
+static void
+fanout_route(struct fanout *fo, struct event *ev, size_t n,
+    const struct timespec *stamp)
+{
+	struct worker *w;
+	size_t i;
+	int j;
+
+	for (i = 0; i < n; i++) {
+		if ((w = fanout_find(fo, ev[i].target)) == NULL) {
+			if (fo->unrouted++ == 0)
+				warnx("no target %d; dropping its events",
+				    ev[i].target);
+			continue;
+		}
+		w->batch[w->nbatch++] = ev[i];
+	}
+	for (j = 0; j < fo->n; j++) {
+		w = &fo->w[j];
+		if (w->nbatch > 0) {
+			fanout_push(fo, w, w->batch, w->nbatch, stamp);
+			w->nbatch = 0;
+		}
+	}
+}
+
+/*
+ * Events mostly come in runs for the same target, so the last one
+ * found is tried first.
+ */
+static struct worker *
+fanout_find(struct fanout *fo, int target)
+{
+	int i;
+
+	if (fo->w[fo->last].target == target)
+		return &fo->w[fo->last];
+	for (i = 0; i < fo->n; i++)
+		if (fo->w[i].target == target) {
+			fo->last = i;
+			return &fo->w[i];
+		}
+	return NULL;
+}
+
+static void
+fanout_push(struct fanout *fo, struct worker *w, struct event *ev,
+    size_t n, const struct timespec *stamp)
+{
+	static struct event reset = { 'r', 0, 0, -1, NULL, -1 };
+	size_t done;
+
+	if (w->lagging) {
+		if (ring_drained(&w->ring) == 0) {
+			w->dropped += n;
+			return;
+		}
+		ring_push(&w->ring, &reset, 1, stamp, -1);
+		w->lagging = 0;
+		warnx("%s: caught up after skipping %llu events", w->name,
+		    w->dropped);
+	}
+
+	done = ring_push(&w->ring, ev, n, stamp, fo->lag);
+	if (done < n) {
+		w->dropped += n - done;
+		w->lagging = 1;
+		w->lags++;
+		warnx("%s: more than %ld ms behind; skipping input until it "
+		    "catches up", w->name, fo->lag);
+	}
+}
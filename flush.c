@@ -0,0 +1,101 @@
+/*
+ * xin - X11 forwarded input receiver
+ * Copyright (c) 2020 Tommi Leino <namhas@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Flush policy.
+ *
+ * Instead of flushing the X connection after every injected event,
+ * requests are left in the output buffer while more input is
+ * already waiting. The buffer is flushed when reading stdin would
+ * block, when the oldest pending request has waited for the latency
+ * bound, or when enough requests are pending.
+ *
+ * While a burst is being injected, the latency and count limits are
+ * held off, and the burst is flushed once at its end.
+ */
+
+#include "xin.h"
+
+#include <err.h>
+
+void
+flush_init(struct flush *fl, struct injector *inj, int max_pending,
+    long latency)
+{
+	fl->inj = inj;
+	fl->max_pending = max_pending;
+	fl->latency = latency;
+	fl->pending = 0;
+	fl->hold = 0;
+	fl->flushes = 0;
+	fl->requests = 0;
+}
+
+/*
+ * Accounts for one more request in the output buffer.
+ */
+void
+flush_request(struct flush *fl)
+{
+	struct timespec now;
+	long waited;
+
+	fl->requests++;
+	if (fl->pending++ == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &fl->oldest);
+		if (fl->max_pending > 1)
+			return;
+	}
+	if (fl->hold)
+		return;
+
+	if (fl->pending >= fl->max_pending) {
+		flush_now(fl);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	waited = (now.tv_sec - fl->oldest.tv_sec) * 1000000L +
+	    (now.tv_nsec - fl->oldest.tv_nsec) / 1000;
+	if (waited >= fl->latency)
+		flush_now(fl);
+}
+
+void
+flush_now(struct flush *fl)
+{
+	struct latency *lt = fl->inj->latency;
+	struct timespec t0;
+
+	if (fl->pending == 0)
+		return;
+	latency_mark(lt, &t0);
+	fl->inj->backend->flush(fl->inj);
+	if (lt != NULL)
+		latency_record(lt, STAGE_FLUSH, lt->last, &t0);
+	fl->pending = 0;
+	fl->flushes++;
+}
+
+void
+flush_stats(struct flush *fl)
+{
+	if (fl->flushes > 0)
+		warnx("%llu requests in %llu flushes; %.1f requests/flush",
+		    fl->requests, fl->flushes,
+		    (double) fl->requests / fl->flushes);
+}
@@ -0,0 +1,167 @@
+/*
+ * xin - X11 forwarded input receiver
+ * Copyright (c) 2020 Tommi Leino <namhas@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Input focus tracking for SendEvent injection.
+ *
+ * Instead of asking for the input focus before every key, the focus
+ * is asked only when it may have changed: when the focused window gets
+ * FocusOut, or when the window manager updates _NET_ACTIVE_WINDOW. The
+ * question is sent through xcb and the answer is picked up whenever it
+ * has arrived, so injecting keys never waits for the server. Keys sent
+ * in the meantime go to the previously known focus window.
+ *
+ * The focus window is selected for FocusChange in addition to the mask
+ * given at startup, which is what the window tree cache selects on
+ * every window, so that the two do not undo each other.
+ */
+
+#include "xin.h"
+
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
+#include <stdlib.h>
+
+static void	focus_query(struct focus *);
+static void	focus_poll(struct focus *);
+static void	focus_set(struct focus *, Window);
+
+void
+focus_init(struct focus *f, Display *dpy, long resync, long mask)
+{
+	xcb_get_input_focus_reply_t *reply;
+
+	f->dpy = dpy;
+	f->conn = XGetXCBConnection(dpy);
+	f->root = RootWindow(dpy, 0);
+	f->win = None;
+	f->resync = resync;
+	f->mask = mask;
+	f->pending = 0;
+	f->queries = 0;
+	f->changes = 0;
+
+	f->net_active = XInternAtom(dpy, "_NET_ACTIVE_WINDOW", False);
+	select_input(dpy, f->root, PropertyChangeMask);
+
+	/* The initial focus is the only one that is waited for. */
+	focus_query(f);
+	reply = xcb_get_input_focus_reply(f->conn, f->cookie, NULL);
+	f->pending = 0;
+	focus_set(f, reply != NULL ? reply->focus : None);
+	free(reply);
+}
+
+/*
+ * Returns 1 if the event was about the input focus.
+ */
+int
+focus_event(struct focus *f, XEvent *e)
+{
+	if (f->dpy == NULL)
+		return 0;
+
+	switch (e->type) {
+	case PropertyNotify:
+		if (e->xproperty.window != f->root ||
+		    e->xproperty.atom != f->net_active)
+			return 0;
+		break;
+	case FocusOut:
+		if (e->xfocus.window != f->win)
+			return 0;
+		break;
+	case FocusIn:
+		return (e->xfocus.window == f->win);
+	default:
+		return 0;
+	}
+
+	focus_query(f);
+	return 1;
+}
+
+/*
+ * Returns the window that should get key events now.
+ */
+Window
+focus_window(struct focus *f)
+{
+	struct timespec now;
+	long elapsed;
+
+	focus_poll(f);
+
+	if (f->resync > 0 && f->pending == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = (now.tv_sec - f->last.tv_sec) * 1000 +
+		    (now.tv_nsec - f->last.tv_nsec) / 1000000;
+		if (elapsed >= f->resync)
+			focus_query(f);
+	}
+
+	if (f->win == None || f->win == PointerRoot)
+		return f->root;
+	return f->win;
+}
+
+static void
+focus_query(struct focus *f)
+{
+	if (f->pending)
+		return;
+	f->cookie = xcb_get_input_focus(f->conn);
+	xcb_flush(f->conn);
+	f->pending = 1;
+	f->queries++;
+	clock_gettime(CLOCK_MONOTONIC, &f->last);
+}
+
+static void
+focus_poll(struct focus *f)
+{
+	xcb_get_input_focus_reply_t *reply;
+	xcb_generic_error_t *error;
+
+	if (f->pending == 0)
+		return;
+	if (xcb_poll_for_reply(f->conn, f->cookie.sequence, (void **) &reply,
+	    &error) == 0)
+		return;
+
+	f->pending = 0;
+	if (reply != NULL) {
+		focus_set(f, reply->focus);
+		free(reply);
+	}
+	free(error);
+}
+
+static void
+focus_set(struct focus *f, Window win)
+{
+	if (win == f->win)
+		return;
+
+	if (f->win != None && f->win != PointerRoot && f->win != f->root)
+		XSelectInput(f->dpy, f->win, f->mask);
+	if (win != None && win != PointerRoot && win != f->root)
+		XSelectInput(f->dpy, win, f->mask | FocusChangeMask);
+	f->win = win;
+	f->changes++;
+}
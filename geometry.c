@@ -0,0 +1,211 @@
+/*
+ * xin - X11 forwarded input receiver
+ * Copyright (c) 2020 Tommi Leino <namhas@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Screen geometry for motion clamping.
+ *
+ * The rectangles of the active CRTCs are cached and the pointer is
+ * kept inside their union, like the server does for real pointer
+ * devices. Without this, a pointer on a multi-head screen whose
+ * monitors do not fill the whole root window could be moved to areas
+ * that no monitor shows. The cache is refreshed only after RandR
+ * tells that the screen or a CRTC has changed.
+ *
+ * The monitors are also what absolute positions of the 'A' command
+ * can be given relative to.
+ */
+
+#include "xin.h"
+
+#include <X11/extensions/Xrandr.h>
+#include <err.h>
+#include <limits.h>
+#include <stdlib.h>
+
+static void	geometry_refresh(struct geometry *);
+static void	add_monitor(struct geometry *, int, int, int, int);
+
+void
+geometry_init(struct geometry *g, Display *dpy)
+{
+	int major, minor;
+
+	g->dpy = dpy;
+	g->mon = NULL;
+	g->nmon = 0;
+	g->cur = 0;
+	g->stale = 1;
+	g->refreshes = 0;
+
+	g->have_randr = 0;
+	if (XRRQueryExtension(dpy, &g->rr_event, &g->rr_error) &&
+	    XRRQueryVersion(dpy, &major, &minor) &&
+	    (major > 1 || (major == 1 && minor >= 2))) {
+		g->have_randr = 1;
+		XRRSelectInput(dpy, RootWindow(dpy, 0),
+		    RRScreenChangeNotifyMask | RRCrtcChangeNotifyMask);
+	}
+}
+
+/*
+ * Returns 1 if the event was a RandR event.
+ */
+int
+geometry_event(struct geometry *g, XEvent *e)
+{
+	if (g->have_randr == 0)
+		return 0;
+
+	if (e->type == g->rr_event + RRScreenChangeNotify) {
+		XRRUpdateConfiguration(e);
+		g->stale = 1;
+		return 1;
+	} else if (e->type == g->rr_event + RRNotify) {
+		if (((XRRNotifyEvent *) e)->subtype == RRNotify_CrtcChange)
+			g->stale = 1;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Returns the index of the monitor containing the point, or -1.
+ */
+int
+geometry_monitor(struct geometry *g, int x, int y)
+{
+	struct monitor *m;
+	int i;
+
+	if (g->stale)
+		geometry_refresh(g);
+
+	m = &g->mon[g->cur];
+	if (x >= m->x && x < m->x + m->w && y >= m->y && y < m->y + m->h)
+		return g->cur;
+
+	for (i = 0; i < g->nmon; i++) {
+		m = &g->mon[i];
+		if (x >= m->x && x < m->x + m->w &&
+		    y >= m->y && y < m->y + m->h)
+			return (g->cur = i);
+	}
+	return -1;
+}
+
+/*
+ * Moves the point to the closest point inside any monitor.
+ */
+void
+geometry_clamp(struct geometry *g, int *x, int *y)
+{
+	struct monitor *m;
+	long d, best;
+	int i, cx, cy, bx, by;
+
+	if (geometry_monitor(g, *x, *y) != -1)
+		return;
+
+	best = LONG_MAX;
+	bx = *x;
+	by = *y;
+	for (i = 0; i < g->nmon; i++) {
+		m = &g->mon[i];
+		cx = *x < m->x ? m->x : *x;
+		if (cx > m->x + m->w - 1)
+			cx = m->x + m->w - 1;
+		cy = *y < m->y ? m->y : *y;
+		if (cy > m->y + m->h - 1)
+			cy = m->y + m->h - 1;
+
+		d = (long) (cx - *x) * (cx - *x) + (long) (cy - *y) * (cy - *y);
+		if (d < best) {
+			best = d;
+			bx = cx;
+			by = cy;
+			g->cur = i;
+		}
+	}
+	*x = bx;
+	*y = by;
+}
+
+/*
+ * Returns monitor i, counting the active CRTCs in the order RandR lists
+ * them, or NULL if there is no such monitor.
+ */
+struct monitor *
+geometry_get(struct geometry *g, int i)
+{
+	if (g->stale)
+		geometry_refresh(g);
+	if (i < 0 || i >= g->nmon)
+		return NULL;
+	return &g->mon[i];
+}
+
+static void
+geometry_refresh(struct geometry *g)
+{
+	XRRScreenResources *res;
+	XRRCrtcInfo *ci;
+	int i;
+
+	g->nmon = 0;
+	g->cur = 0;
+
+	if (g->have_randr &&
+	    (res = XRRGetScreenResourcesCurrent(g->dpy,
+	    RootWindow(g->dpy, 0))) != NULL) {
+		for (i = 0; i < res->ncrtc; i++) {
+			ci = XRRGetCrtcInfo(g->dpy, res, res->crtcs[i]);
+			if (ci == NULL)
+				continue;
+			if (ci->mode != None && ci->noutput > 0 &&
+			    ci->width > 0 && ci->height > 0)
+				add_monitor(g, ci->x, ci->y, ci->width,
+				    ci->height);
+			XRRFreeCrtcInfo(ci);
+		}
+		XRRFreeScreenResources(res);
+	}
+
+	/* No RandR, or everything is off: use the whole screen. */
+	if (g->nmon == 0)
+		add_monitor(g, 0, 0, DisplayWidth(g->dpy, 0),
+		    DisplayHeight(g->dpy, 0));
+
+	g->stale = 0;
+	g->refreshes++;
+}
+
+static void
+add_monitor(struct geometry *g, int x, int y, int w, int h)
+{
+	struct monitor *m;
+
+	m = reallocarray(g->mon, g->nmon + 1, sizeof(*g->mon));
+	if (m == NULL)
+		err(1, "reallocarray");
+	g->mon = m;
+
+	m = &g->mon[g->nmon++];
+	m->x = x;
+	m->y = y;
+	m->w = w;
+	m->h = h;
+}
@@ -0,0 +1,448 @@
+/*
+ * xin - X11 forwarded input receiver
+ * Copyright (c) 2020 Tommi Leino <namhas@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Keysym to keycode and modifier cache.
+ *
+ * The whole keyboard mapping is fetched with one XkbGetMap() and
+ * turned into an open addressing hash table, so that resolving a
+ * keysym is a single lookup instead of a walk over Xlib's keymap
+ * tables. The table is marked stale on MappingNotify and rebuilt on
+ * the next lookup.
+ *
+ * There is one table per keyboard group, each preferring the keys of
+ * its own group, and lookups use the table of the current group. This
+ * way switching between preloaded layouts with a group lock needs no
+ * rebuild at all.
+ *
+ * Keysyms that no key produces are mapped on demand on scratch keys,
+ * the highest run of keycodes without any symbols, with
+ * XChangeKeyboardMapping(). The scratch keys are left out of the table
+ * and kept in a small array of their own, reused least recently used
+ * first, so that typing the same characters again needs no remapping.
+ * Everything missing from a text is mapped with one request, and the
+ * MappingNotify it causes is recognized as ours and does not make the
+ * table stale.
+ */
+
+#include "xin.h"
+
+#include <X11/XKBlib.h>
+#include <err.h>
+#include <stdlib.h>
+
+static void		keymap_build(struct keymap *);
+static void		keymap_build_from(struct keymap *, XkbDescPtr);
+static void		keymap_fill(struct keymap *, int, XkbDescPtr, int);
+static void		keymap_add_level(struct keymap *, struct keyent *,
+			    XkbDescPtr, int, int);
+static struct keyent	*keymap_slot(struct keymap *, struct keyent *,
+			    KeySym);
+static void		keymap_pool(struct keymap *, XkbDescPtr);
+static int		keymap_unused(struct keymap *, XkbDescPtr, int);
+
+void
+keymap_init(struct keymap *km, Display *dpy, int xkb_event)
+{
+	XkbStateRec state;
+	int g;
+
+	km->dpy = dpy;
+	for (g = 0; g < XkbNumKbdGroups; g++)
+		km->tab[g] = NULL;
+	km->ngroups = 0;
+	km->mask = 0;
+	km->stale = 1;
+	km->serial = 0;
+	km->builds = 0;
+
+	for (g = 0; g < SCRATCH_KEYS; g++)
+		km->scratch[g].keysym = NoSymbol;
+	km->first = 0;
+	km->nscratch = 0;
+	km->lo = SCRATCH_KEYS;
+	km->hi = -1;
+	km->oldest = 0;
+	km->inflight = 0;
+	km->clock = 0;
+	km->batch = 1;
+	km->remaps = 0;
+	km->evictions = 0;
+
+	km->xkb_event = xkb_event;
+	km->group = 0;
+	if (XkbGetState(dpy, XkbUseCoreKbd, &state) == Success)
+		km->group = state.group;
+	XkbSelectEventDetails(dpy, XkbUseCoreKbd, XkbStateNotify,
+	    XkbGroupStateMask, XkbGroupStateMask);
+}
+
+/*
+ * Follows the keyboard group. Returns 1 if the event was handled.
+ */
+int
+keymap_event(struct keymap *km, XEvent *e)
+{
+	XkbEvent *xe = (XkbEvent *) e;
+
+	if (e->type != km->xkb_event)
+		return 0;
+	if (xe->any.xkb_type == XkbStateNotify)
+		keymap_set_group(km, xe->state.group);
+	return 1;
+}
+
+void
+keymap_set_group(struct keymap *km, int group)
+{
+	if (group >= 0 && group < XkbNumKbdGroups)
+		km->group = group;
+}
+
+void
+keymap_invalidate(struct keymap *km)
+{
+	km->stale = 1;
+}
+
+/*
+ * Returns the keycode for a keysym, or 0 if no key produces it. The
+ * modifiers bound to the keys producing the keysym are stored in mods
+ * like XkbKeysymToModifiers() would return them.
+ */
+KeyCode
+keymap_lookup(struct keymap *km, KeySym keysym, unsigned int *mods)
+{
+	struct keyent *ke;
+	int i;
+
+	if (km->stale)
+		keymap_build(km);
+
+	ke = keymap_slot(km, km->tab[km->group < km->ngroups ? km->group : 0],
+	    keysym);
+	if (ke->keysym == keysym) {
+		*mods = ke->mods;
+		return ke->keycode;
+	}
+
+	*mods = 0;
+	for (i = 0; i < km->nscratch; i++)
+		if (km->scratch[i].keysym == keysym) {
+			km->scratch[i].used = ++km->clock;
+			return km->first + i;
+		}
+	return 0;
+}
+
+/*
+ * Scratch keys used from now on are not taken for other keysyms until
+ * the next call, so that a whole text can be mapped at once.
+ */
+void
+keymap_pin(struct keymap *km)
+{
+	km->batch = km->clock + 1;
+}
+
+/*
+ * Puts a keysym on the least recently used scratch key that is neither
+ * held down nor pinned. The change is sent by keymap_remap(). Returns
+ * the keycode, or 0 if there is no key to take.
+ */
+KeyCode
+keymap_scratch(struct keymap *km, KeySym keysym, const unsigned char *keys)
+{
+	struct scratch *s;
+	int i, kc, best;
+
+	if (km->stale)
+		keymap_build(km);
+
+	best = -1;
+	for (i = 0; i < km->nscratch; i++) {
+		s = &km->scratch[i];
+		kc = km->first + i;
+		if ((keys[kc / 8] & (1 << (kc % 8))) ||
+		    (s->keysym != NoSymbol && s->used >= km->batch))
+			continue;
+		if (best == -1 || s->used < km->scratch[best].used)
+			best = i;
+	}
+	if (best == -1)
+		return 0;
+
+	s = &km->scratch[best];
+	if (s->keysym != NoSymbol)
+		km->evictions++;
+	s->keysym = keysym;
+	s->used = ++km->clock;
+	if (best < km->lo)
+		km->lo = best;
+	if (best > km->hi)
+		km->hi = best;
+	return km->first + best;
+}
+
+/*
+ * Sends the scratch keys changed since the last call with a single
+ * request. Returns 1 if there were any.
+ */
+int
+keymap_remap(struct keymap *km)
+{
+	KeySym syms[2 * SCRATCH_KEYS];
+	int i, n;
+
+	keymap_pin(km);
+	if (km->lo > km->hi)
+		return 0;
+
+	/* The same keysym on both levels, so that Shift does not matter. */
+	for (n = 0, i = km->lo; i <= km->hi; i++) {
+		syms[n++] = km->scratch[i].keysym;
+		syms[n++] = km->scratch[i].keysym;
+	}
+	if (km->inflight == REMAPS_MAX) {
+		km->oldest = (km->oldest + 1) % REMAPS_MAX;
+		km->inflight--;
+	}
+	km->remap[(km->oldest + km->inflight++) % REMAPS_MAX] =
+	    NextRequest(km->dpy);
+	XChangeKeyboardMapping(km->dpy, km->first + km->lo, 2, syms,
+	    km->hi - km->lo + 1);
+	km->lo = SCRATCH_KEYS;
+	km->hi = -1;
+	km->remaps++;
+	return 1;
+}
+
+/*
+ * Returns 1 if a MappingNotify is for a remap of our scratch keys, so
+ * that the table does not need to be rebuilt. Events come in request
+ * order, so ours carries the serial of the oldest remap in flight; a
+ * remap older than the event that has not been notified failed, and
+ * never will be. Anything else is a change by another client, even if
+ * it touches the scratch keys.
+ */
+int
+keymap_own(struct keymap *km, XMappingEvent *e)
+{
+	unsigned long serial;
+
+	if (e->request != MappingKeyboard)
+		return 0;
+	while (km->inflight > 0) {
+		serial = km->remap[km->oldest];
+		if ((long) (serial - e->serial) >= 0)
+			break;
+		km->oldest = (km->oldest + 1) % REMAPS_MAX;
+		km->inflight--;
+	}
+	if (km->inflight == 0 || km->remap[km->oldest] != e->serial)
+		return 0;
+	km->oldest = (km->oldest + 1) % REMAPS_MAX;
+	km->inflight--;
+	return 1;
+}
+
+static struct keyent *
+keymap_slot(struct keymap *km, struct keyent *tab, KeySym keysym)
+{
+	size_t i;
+
+	i = ((unsigned long) keysym * 2654435761UL) & km->mask;
+	while (tab[i].keysym != NoSymbol && tab[i].keysym != keysym)
+		i = (i + 1) & km->mask;
+	return &tab[i];
+}
+
+/*
+ * Keys are entered in about the same order XKeysymToKeycode() would
+ * search the core mapping, except that the table's own group comes
+ * first: the first two levels before the rest, and lower keycodes
+ * first. The first keycode found for a keysym wins, but the modifiers
+ * of every key producing it are collected.
+ */
+static void
+keymap_build(struct keymap *km)
+{
+	XkbDescPtr xkb;
+
+	xkb = XkbGetMap(km->dpy, XkbKeyTypesMask | XkbKeySymsMask |
+	    XkbModifierMapMask, XkbUseCoreKbd);
+	if (xkb == NULL)
+		errx(1, "couldn't get keyboard mapping");
+	keymap_build_from(km, xkb);
+	XkbFreeKeyboard(xkb, 0, True);
+}
+
+/*
+ * Builds the tables from a keymap the server has just loaded for us,
+ * which was requested as serial. The MappingNotify that the load
+ * causes then need not make them stale again.
+ */
+void
+keymap_load(struct keymap *km, XkbDescPtr xkb, unsigned long serial)
+{
+	keymap_build_from(km, xkb);
+	km->serial = serial;
+}
+
+/*
+ * Returns 1 if a MappingNotify was caused by the load of keymap_load().
+ */
+int
+keymap_loaded(struct keymap *km, XMappingEvent *e)
+{
+	return km->serial != 0 && e->serial == km->serial;
+}
+
+static void
+keymap_build_from(struct keymap *km, XkbDescPtr xkb)
+{
+	size_t size;
+	int kc, g, t, width, maxwidth;
+
+	size = 0;
+	maxwidth = 0;
+	km->ngroups = 1;
+	for (kc = xkb->min_key_code; kc <= xkb->max_key_code; kc++) {
+		size += XkbKeyNumSyms(xkb, kc);
+		if (XkbKeyNumGroups(xkb, kc) > km->ngroups)
+			km->ngroups = XkbKeyNumGroups(xkb, kc);
+		for (g = 0; g < XkbKeyNumGroups(xkb, kc); g++)
+			if ((width = XkbKeyGroupWidth(xkb, kc, g)) > maxwidth)
+				maxwidth = width;
+	}
+	for (size *= 2, km->mask = 1; km->mask < size; km->mask <<= 1)
+		;
+
+	for (t = 0; t < XkbNumKbdGroups; t++) {
+		free(km->tab[t]);
+		km->tab[t] = NULL;
+	}
+	for (t = 0; t < km->ngroups; t++)
+		if ((km->tab[t] = calloc(km->mask,
+		    sizeof(*km->tab[t]))) == NULL)
+			err(1, "calloc");
+	km->mask--;
+
+	keymap_pool(km, xkb);
+	for (t = 0; t < km->ngroups; t++)
+		keymap_fill(km, t, xkb, maxwidth);
+
+	km->stale = 0;
+	km->serial = 0;
+	km->builds++;
+}
+
+/*
+ * Passes 0 and 1 add the first two levels, and passes 0 and 2 add the
+ * table's own group.
+ */
+static void
+keymap_fill(struct keymap *km, int t, XkbDescPtr xkb, int maxwidth)
+{
+	int pass, g, l;
+
+	for (pass = 0; pass < 4; pass++)
+		for (g = 0; g < km->ngroups; g++)
+			for (l = 0; l < maxwidth; l++)
+				if ((g != t) == (pass & 1) &&
+				    (l >= 2) == (pass >> 1))
+					keymap_add_level(km, km->tab[t], xkb,
+					    g, l);
+}
+
+static void
+keymap_add_level(struct keymap *km, struct keyent *tab, XkbDescPtr xkb,
+    int group, int level)
+{
+	struct keyent *ke;
+	KeySym keysym;
+	int kc;
+
+	for (kc = xkb->min_key_code; kc <= xkb->max_key_code; kc++) {
+		if (kc >= km->first && kc < km->first + km->nscratch)
+			continue;
+		if (group >= XkbKeyNumGroups(xkb, kc) ||
+		    level >= XkbKeyGroupWidth(xkb, kc, group))
+			continue;
+		if ((keysym = XkbKeySymEntry(xkb, kc, level, group)) == NoSymbol)
+			continue;
+
+		ke = keymap_slot(km, tab, keysym);
+		if (ke->keysym == NoSymbol) {
+			ke->keysym = keysym;
+			ke->keycode = kc;
+			ke->mods = xkb->map->modmap[kc];
+		} else
+			ke->mods |= xkb->map->modmap[kc];
+	}
+}
+
+/*
+ * Takes the highest run of unused keycodes for the scratch keys. What
+ * was mapped on them before is kept if it is still there.
+ */
+static void
+keymap_pool(struct keymap *km, XkbDescPtr xkb)
+{
+	struct scratch *s;
+	int kc, first, n, i;
+
+	first = 0;
+	n = 0;
+	for (kc = xkb->max_key_code; kc >= xkb->min_key_code &&
+	    n < SCRATCH_KEYS; kc--) {
+		if (keymap_unused(km, xkb, kc)) {
+			first = kc;
+			n++;
+		} else if (n > 0)
+			break;
+	}
+
+	km->first = first;
+	km->nscratch = n;
+	for (i = 0; i < n; i++) {
+		s = &km->scratch[i];
+		kc = first + i;
+		s->keysym = XkbKeyNumSyms(xkb, kc) > 0 ?
+		    XkbKeySymEntry(xkb, kc, 0, 0) : NoSymbol;
+		s->used = 0;
+	}
+	km->lo = SCRATCH_KEYS;
+	km->hi = -1;
+}
+
+/*
+ * A key is unused if it has no symbols, or if it is a scratch key that
+ * still has the keysym we mapped on it.
+ */
+static int
+keymap_unused(struct keymap *km, XkbDescPtr xkb, int kc)
+{
+	KeySym keysym;
+
+	if (XkbKeyNumSyms(xkb, kc) == 0)
+		return 1;
+	if (kc < km->first || kc >= km->first + km->nscratch)
+		return 0;
+	keysym = km->scratch[kc - km->first].keysym;
+	return keysym != NoSymbol && XkbKeySymEntry(xkb, kc, 0, 0) == keysym;
+}
@@ -0,0 +1,199 @@
+/*
+ * xin - X11 forwarded input receiver
+ * Copyright (c) 2020 Tommi Leino <namhas@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Per-stage latency histograms.
+ *
+ * Each stage of handling an event is timed and counted into a
+ * log-linear histogram of its event type: values below 2^HIST_SUBBITS
+ * nanoseconds have a bucket of their own, and every power of two above
+ * that is split into 2^HIST_SUBBITS linear buckets. Recording is an
+ * index computation and an increment, so the cost is dominated by the
+ * clock_gettime() calls, which are not made at all unless -H is given.
+ *
+ * Parsing is done for a whole batch at a time, and its time is divided
+ * evenly between the events of the batch. A flush is accounted to the
+ * type of the event dispatched last before it.
+ */
+
+#include "xin.h"
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static const char *stages[NSTAGES] = {
+	"parse",
+	"lookup",
+	"request",
+	"flush",
+	"total"
+};
+
+static unsigned long long	 hist_value(int);
+
+struct latency *
+latency_new(void)
+{
+	struct latency *lt;
+
+	if ((lt = calloc(1, sizeof(*lt))) == NULL)
+		err(1, "calloc");
+	return lt;
+}
+
+void
+latency_mark(struct latency *lt, struct timespec *ts)
+{
+	if (lt != NULL)
+		clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+/*
+ * Records the time elapsed since a latency_mark().
+ */
+void
+latency_record(struct latency *lt, int stage, char c,
+    const struct timespec *start)
+{
+	struct timespec now;
+	long long ns;
+	int type;
+
+	if (lt == NULL || (type = event_index(c)) == -1)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ns = (now.tv_sec - start->tv_sec) * 1000000000LL +
+	    (now.tv_nsec - start->tv_nsec);
+	hist_add(&lt->h[stage][type], ns > 0 ? ns : 0);
+}
+
+/*
+ * Records the parse time of a batch of n events.
+ */
+void
+latency_parsed(struct latency *lt, const struct timespec *start,
+    struct event *ev, size_t n)
+{
+	struct timespec now;
+	unsigned long long ns;
+	size_t i;
+	int type;
+
+	if (lt == NULL || n == 0)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ns = ((now.tv_sec - start->tv_sec) * 1000000000LL +
+	    (now.tv_nsec - start->tv_nsec)) / n;
+	for (i = 0; i < n; i++)
+		if ((type = event_index(ev[i].type)) != -1)
+			hist_add(&lt->h[STAGE_PARSE][type], ns);
+}
+
+/*
+ * Adds the histograms of src to those of dst.
+ */
+void
+latency_merge(struct latency *dst, struct latency *src)
+{
+	struct hist *d, *h;
+	int s, t, i;
+
+	for (s = 0; s < NSTAGES; s++)
+		for (t = 0; t < NTYPES; t++) {
+			d = &dst->h[s][t];
+			h = &src->h[s][t];
+			for (i = 0; i < HIST_BUCKETS; i++)
+				d->count[i] += h->count[i];
+			d->total += h->total;
+			if (h->max > d->max)
+				d->max = h->max;
+		}
+}
+
+void
+latency_dump(struct latency *lt)
+{
+	struct hist *h;
+	int s, t;
+
+	fprintf(stderr, "%-8s %-4s %12s %10s %10s %10s %10s\n", "stage",
+	    "type", "count", "p50 us", "p99 us", "p99.9 us", "max us");
+	for (s = 0; s < NSTAGES; s++)
+		for (t = 0; t < NTYPES; t++) {
+			h = &lt->h[s][t];
+			if (h->total == 0)
+				continue;
+			fprintf(stderr, "%-8s %-4c %12llu %10.1f %10.1f "
+			    "%10.1f %10.1f\n", stages[s], EVENT_TYPES[t], h->total,
+			    hist_percentile(h, 50) / 1e3,
+			    hist_percentile(h, 99) / 1e3,
+			    hist_percentile(h, 99.9) / 1e3, h->max / 1e3);
+		}
+	fflush(stderr);
+}
+
+void
+hist_add(struct hist *h, unsigned long long v)
+{
+	int e, i;
+
+	if (v >= 1ULL << HIST_MAXBITS)
+		v = (1ULL << HIST_MAXBITS) - 1;
+	if (v < 1ULL << HIST_SUBBITS)
+		i = v;
+	else {
+		e = 63 - __builtin_clzll(v);
+		i = ((e - HIST_SUBBITS + 1) << HIST_SUBBITS) +
+		    (int) (v >> (e - HIST_SUBBITS)) - (1 << HIST_SUBBITS);
+	}
+	h->count[i]++;
+	h->total++;
+	if (v > h->max)
+		h->max = v;
+}
+
+/*
+ * Highest value counted into a bucket.
+ */
+static unsigned long long
+hist_value(int i)
+{
+	int e, m;
+
+	if (i < 1 << HIST_SUBBITS)
+		return i;
+	e = (i >> HIST_SUBBITS) + HIST_SUBBITS - 1;
+	m = (i & ((1 << HIST_SUBBITS) - 1)) + (1 << HIST_SUBBITS);
+	return (((unsigned long long) m + 1) << (e - HIST_SUBBITS)) - 1;
+}
+
+unsigned long long
+hist_percentile(struct hist *h, double pct)
+{
+	unsigned long long want, seen, v;
+	int i;
+
+	want = (unsigned long long) (h->total * pct / 100 + 0.5);
+	if (want == 0)
+		want = 1;
+	for (seen = 0, i = 0; i < HIST_BUCKETS; i++)
+		if ((seen += h->count[i]) >= want)
+			break;
+	v = hist_value(i < HIST_BUCKETS ? i : HIST_BUCKETS - 1);
+	return v < h->max ? v : h->max;
+}
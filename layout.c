@@ -0,0 +1,426 @@
+/*
+ * xin - X11 forwarded input receiver
+ * Copyright (c) 2020 Tommi Leino <namhas@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Keyboard layout switching.
+ *
+ * The new keymap is compiled and loaded by the server with
+ * XkbGetKeyboardByName(), using the current keymap's component names
+ * with the layout part of the symbols replaced, much like setxkbmap
+ * would do it with the default rules. Loading is a round trip lasting
+ * as long as the server takes to compile the keymap, but the keys after
+ * the switch need the new map anyway. The keysym cache is built from
+ * the map the server returns, so injection continues without waiting
+ * for MappingNotify or fetching the map again; the MappingNotify is
+ * only used for the latency metric and a warning if it does not come
+ * in time.
+ *
+ * If the server cannot load the keymap, setxkbmap is run like before.
+ *
+ * Layouts given with -L are preloaded into the groups of one keymap,
+ * and switching to one of them is just a group lock. Switching to any
+ * other layout loads it like above, and the preloaded keymap is loaded
+ * again when one of its layouts is wanted next.
+ *
+ * Every switch is timed for the latency metric: a load until its
+ * MappingNotify, a group lock until the XkbStateNotify with the new
+ * locked group, and setxkbmap until it has exited.
+ */
+
+#include "xin.h"
+
+#include <X11/XKBlib.h>
+#include <X11/extensions/XKBstr.h>
+#include <ctype.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int	layout_valid(const char *);
+static int	layout_load(struct injector *, const char *);
+static int	layout_load_groups(struct injector *);
+static void	layout_lock(struct injector *, int);
+static void	layout_exec(struct injector *, const char *);
+static void	layout_done(struct layout *);
+static int	make_symbols(char *, size_t, const char *, const char *);
+static double	elapsed_ms(const struct timespec *);
+
+void
+layout_init(struct layout *lt, long timeout)
+{
+	memset(lt, 0, sizeof(*lt));
+	lt->timeout = timeout;
+	lt->lock = -1;
+}
+
+/*
+ * Loads a keymap with the comma separated layouts in its groups.
+ */
+void
+layout_preload(struct injector *inj, char *list)
+{
+	struct layout *lt = &inj->layout;
+	char *name;
+
+	for (name = strtok(list, ","); name != NULL;
+	    name = strtok(NULL, ",")) {
+		if (lt->npreload == MAXGROUPS)
+			errx(1, "at most %d layouts can be preloaded",
+			    MAXGROUPS);
+		if (layout_valid(name) == -1 ||
+		    strlen(name) >= sizeof(lt->preload[0]))
+			errx(1, "invalid layout name '%s'", name);
+		snprintf(lt->preload[lt->npreload++], sizeof(lt->preload[0]),
+		    "%s", name);
+	}
+
+	if (lt->npreload > 0 && layout_load_groups(inj) == -1) {
+		warnx("couldn't preload layouts");
+		lt->npreload = 0;
+	}
+}
+
+void
+layout_switch(struct injector *inj, const char *name)
+{
+	struct layout *lt = &inj->layout;
+	int i;
+
+	if (layout_valid(name) == -1) {
+		warnx("layout name cannot contain special "
+		    "characters");
+		return;
+	}
+	if (strlen(name) >= sizeof(lt->name)) {
+		warnx("layout name too long");
+		return;
+	}
+
+	flush_now(&inj->flush);
+	clock_gettime(CLOCK_MONOTONIC, &lt->start);
+	snprintf(lt->name, sizeof(lt->name), "%s", name);
+	lt->switches++;
+
+	for (i = 0; i < lt->npreload; i++)
+		if (strcmp(name, lt->preload[i]) == 0)
+			break;
+	if (i < lt->npreload &&
+	    (lt->preloaded || layout_load_groups(inj) == 0)) {
+		lt->locks++;
+		if (lt->pending == 0 && inj->keymap.group == i) {
+			layout_done(lt);
+			return;
+		}
+		layout_lock(inj, i);
+		lt->lock = i;
+		lt->pending = 1;
+		return;
+	}
+
+	if (layout_load(inj, name) == 0) {
+		lt->preloaded = 0;
+		lt->lock = -1;
+		lt->pending = 1;
+		return;
+	}
+	lt->preloaded = 0;
+	lt->pending = 0;
+	lt->lock = -1;
+
+	lt->fallbacks++;
+	layout_exec(inj, name);
+	layout_done(lt);
+}
+
+/*
+ * Called on MappingNotify.
+ */
+void
+layout_mapped(struct layout *lt)
+{
+	if (lt->pending && lt->lock == -1) {
+		layout_done(lt);
+		lt->pending = 0;
+	}
+}
+
+/*
+ * Called on XkbStateNotify with the locked group.
+ */
+void
+layout_locked(struct layout *lt, int group)
+{
+	if (lt->pending && lt->lock != -1 && group == lt->lock) {
+		layout_done(lt);
+		lt->pending = 0;
+		lt->lock = -1;
+	}
+}
+
+/*
+ * Milliseconds until a pending switch times out, or -1.
+ */
+int
+layout_timeout(struct layout *lt)
+{
+	double left;
+
+	if (lt->pending == 0)
+		return -1;
+	left = lt->timeout - elapsed_ms(&lt->start);
+	return left > 0 ? (int) left + 1 : 0;
+}
+
+void
+layout_check(struct layout *lt)
+{
+	if (lt->pending == 0 || elapsed_ms(&lt->start) < lt->timeout)
+		return;
+
+	warnx("layout '%s' not confirmed by the server in %ld ms",
+	    lt->name, lt->timeout);
+	lt->timeouts++;
+	lt->pending = 0;
+	lt->lock = -1;
+}
+
+void
+layout_stats(struct layout *lt)
+{
+	if (lt->switches == 0)
+		return;
+	warnx("%llu layout switches, %llu group locks, %llu with setxkbmap, "
+	    "%llu timeouts; %.1f ms average, %.1f ms max", lt->switches,
+	    lt->locks, lt->fallbacks, lt->timeouts,
+	    lt->mapped > 0 ? lt->total_ms / lt->mapped : 0, lt->max_ms);
+}
+
+static int
+layout_valid(const char *name)
+{
+	const char *p;
+
+	for (p = name; *p != '\0'; p++)
+		if (isalpha((unsigned char) *p) == 0)
+			return -1;
+	return (p == name) ? -1 : 0;
+}
+
+/*
+ * Group locks do not cause MappingNotify, so there is nothing to wait
+ * for; the keysym cache just starts using the table of the group.
+ * Keys written to uinput do not go through our requests, so with it the
+ * lock is waited for, or the keys could arrive in the old group.
+ */
+static void
+layout_lock(struct injector *inj, int group)
+{
+	XkbLockGroup(inj->dpy, XkbUseCoreKbd, group);
+	if (inj->backend == &uinput_backend)
+		XSync(inj->dpy, False);
+	keymap_set_group(&inj->keymap, group);
+}
+
+static int
+layout_load_groups(struct injector *inj)
+{
+	struct layout *lt = &inj->layout;
+	char s[128];
+	size_t n;
+	int i;
+
+	n = 0;
+	for (i = 0; i < lt->npreload; i++) {
+		n += snprintf(&s[n], sizeof(s) - n, i == 0 ? "%s" : "+%s:%d",
+		    lt->preload[i], i + 1);
+		if (n >= sizeof(s))
+			return -1;
+	}
+
+	if (layout_load(inj, s) == -1)
+		return -1;
+	layout_lock(inj, 0);
+	lt->preloaded = 1;
+	return 0;
+}
+
+static int
+layout_load(struct injector *inj, const char *name)
+{
+	XkbComponentNamesRec names;
+	XkbDescPtr xkb, new;
+	Atom atoms[4];
+	char *cur[4], symbols[256];
+	unsigned long serial;
+	int i, ret;
+
+	if ((xkb = XkbAllocKeyboard()) == NULL)
+		return -1;
+	if (XkbGetNames(inj->dpy, XkbKeycodesNameMask | XkbTypesNameMask |
+	    XkbCompatNameMask | XkbSymbolsNameMask, xkb) != Success) {
+		XkbFreeKeyboard(xkb, 0, True);
+		return -1;
+	}
+
+	atoms[0] = xkb->names->keycodes;
+	atoms[1] = xkb->names->types;
+	atoms[2] = xkb->names->compat;
+	atoms[3] = xkb->names->symbols;
+	XkbFreeKeyboard(xkb, 0, True);
+	for (i = 0; i < 4; i++)
+		if (atoms[i] == None)
+			return -1;
+	if (XGetAtomNames(inj->dpy, atoms, 4, cur) == 0)
+		return -1;
+
+	ret = -1;
+	if (make_symbols(symbols, sizeof(symbols), cur[3], name) == 0) {
+		memset(&names, 0, sizeof(names));
+		names.keycodes = cur[0];
+		names.types = cur[1];
+		names.compat = cur[2];
+		names.symbols = symbols;
+
+		serial = NextRequest(inj->dpy);
+		new = XkbGetKeyboardByName(inj->dpy, XkbUseCoreKbd, &names,
+		    XkbGBN_AllComponentsMask & ~XkbGBN_GeometryMask,
+		    XkbGBN_AllComponentsMask & ~XkbGBN_GeometryMask, True);
+		if (new != NULL) {
+			keymap_load(&inj->keymap, new, serial);
+			XkbFreeKeyboard(new, 0, True);
+			ret = 0;
+		} else
+			warnx("couldn't load layout '%s'; trying setxkbmap",
+			    name);
+	}
+
+	for (i = 0; i < 4; i++)
+		XFree(cur[i]);
+	return ret;
+}
+
+/*
+ * Replaces the layout in a symbols name like "pc+us+inet(evdev)". The
+ * layout is the first part after "pc", and parts like "fi:2" are the
+ * layouts of other groups, which setxkbmap would also drop.
+ */
+static int
+make_symbols(char *buf, size_t size, const char *cur, const char *layout)
+{
+	const char *p, *end;
+	size_t len, n;
+	int first, replaced;
+
+	n = 0;
+	buf[0] = '\0';
+	replaced = 0;
+	for (p = cur, first = 1; *p != '\0'; p = end, first = 0) {
+		if (*p == '+')
+			p++;
+		end = p + strcspn(p, "+");
+		len = end - p;
+
+		if (memchr(p, ':', len) != NULL)
+			continue;
+		if (replaced == 0 && !(first && len == 2 &&
+		    strncmp(p, "pc", 2) == 0)) {
+			p = layout;
+			len = strlen(layout);
+			replaced = 1;
+		}
+
+		if (n + len + 2 > size)
+			return -1;
+		if (n > 0)
+			buf[n++] = '+';
+		memcpy(&buf[n], p, len);
+		buf[n += len] = '\0';
+	}
+
+	if (replaced == 0) {
+		if (n + strlen(layout) + 2 > size)
+			return -1;
+		if (n > 0)
+			buf[n++] = '+';
+		snprintf(&buf[n], size - n, "%s", layout);
+	}
+	return 0;
+}
+
+/*
+ * The old way: run setxkbmap and wait for the MappingNotify it causes.
+ */
+static void
+layout_exec(struct injector *inj, const char *layout)
+{
+	Display *dpy = inj->dpy;
+	char s[256];
+	XEvent e;
+
+	if (snprintf(s, sizeof(s), "setxkbmap -display '%s' %s",
+	    DisplayString(dpy), layout) >= sizeof(s)) {
+		warnx("layout name too long");
+		return;
+	}
+
+	XGrabKey(dpy, XKeysymToKeycode(dpy, XStringToKeysym("Super_L")), 0,
+	    RootWindow(dpy, 0), 0, 0, 1);
+	XSync(dpy, False);
+
+	while (XCheckTypedEvent(dpy, MappingNotify, &e) == True)
+		xevent(inj, &e);
+
+	if (system(s) == -1)
+		err(1, "system");
+
+	do {
+		XNextEvent(dpy, &e);
+		xevent(inj, &e);
+	} while (e.type != MappingNotify);
+
+	/*
+	 * We need to wait for an event from the keymap change
+	 * before we can continue because we need to refresh
+	 * internal keysym to keycode mapping.
+	 */
+
+	while (XCheckTypedEvent(dpy, MappingNotify, &e) == True)
+		xevent(inj, &e);
+}
+
+static void
+layout_done(struct layout *lt)
+{
+	double ms;
+
+	ms = elapsed_ms(&lt->start);
+	lt->total_ms += ms;
+	if (ms > lt->max_ms)
+		lt->max_ms = ms;
+	lt->mapped++;
+}
+
+static double
+elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1e3 +
+	    (now.tv_nsec - start->tv_nsec) / 1e6;
+}
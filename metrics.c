@@ -0,0 +1,296 @@
+/*
+ * xin - X11 forwarded input receiver
+ * Copyright (c) 2020 Tommi Leino <namhas@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Statistics in Prometheus text format over a Unix domain socket.
+ *
+ * A client connecting to the socket gets one HTTP/1.0 response with
+ * the current counters as soon as it sends its request, whatever the
+ * request is, so that the socket can be scraped with curl --unix-socket
+ * or through a proxy. Sockets are only touched when poll() says they
+ * are ready, and the whole response is written with one non-blocking
+ * write; it is small enough to fit in the socket buffer, and a client
+ * that does not take it all is dropped instead of waited for. So is
+ * the oldest client when too many are connected at once.
+ */
+
+#include "xin.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+struct page {
+	char	 buf[8192];
+	size_t	 len;
+};
+
+static void	metrics_accept(struct metrics *);
+static void	metrics_reply(struct metrics *, int);
+static void	metrics_page(struct metrics *, struct page *);
+static void	put(struct page *, const char *, ...)
+		    __attribute__((format(printf, 2, 3)));
+static void	counter(struct page *, const char *, unsigned long long);
+static void	gauge(struct page *, const char *, double);
+
+void
+metrics_init(struct metrics *mt, const char *path, struct reader *rd,
+    struct injector *inj)
+{
+	struct sockaddr_un sun;
+
+	int i;
+
+	memset(mt, 0, sizeof(*mt));
+	mt->fd = -1;
+	for (i = 0; i < METRICS_CLIENTS; i++)
+		mt->client[i] = -1;
+	mt->rd = rd;
+	mt->inj = inj;
+	if (path == NULL)
+		return;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", path) >=
+	    (int) sizeof(sun.sun_path))
+		errx(1, "socket path too long: %s", path);
+
+	if ((mt->fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		err(1, "socket");
+	if (unlink(path) == -1 && errno != ENOENT)
+		err(1, "unlink %s", path);
+	if (bind(mt->fd, (struct sockaddr *) &sun, sizeof(sun)) == -1)
+		err(1, "bind %s", path);
+	if (listen(mt->fd, 4) == -1)
+		err(1, "listen");
+	if (fcntl(mt->fd, F_SETFL, O_NONBLOCK) == -1)
+		err(1, "fcntl");
+
+	/* A scraper going away must not take us with it. */
+	signal(SIGPIPE, SIG_IGN);
+}
+
+/*
+ * Fills in the poll entries of the socket and its clients.
+ */
+void
+metrics_pollfd(struct metrics *mt, struct pollfd *pfd)
+{
+	int i;
+
+	pfd[0].fd = mt != NULL ? mt->fd : -1;
+	pfd[0].events = POLLIN;
+	for (i = 0; i < METRICS_CLIENTS; i++) {
+		pfd[i + 1].fd = mt != NULL ? mt->client[i] : -1;
+		pfd[i + 1].events = POLLIN;
+	}
+}
+
+void
+metrics_serve(struct metrics *mt, struct pollfd *pfd)
+{
+	int i;
+
+	for (i = 0; i < METRICS_CLIENTS; i++)
+		if (pfd[i + 1].fd != -1 && pfd[i + 1].fd == mt->client[i] &&
+		    (pfd[i + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+			metrics_reply(mt, i);
+	if (pfd[0].revents & POLLIN)
+		metrics_accept(mt);
+}
+
+static void
+metrics_accept(struct metrics *mt)
+{
+	int fd, i;
+
+	while ((fd = accept(mt->fd, NULL, NULL)) != -1) {
+		if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+			close(fd);
+			continue;
+		}
+		if (mt->client[METRICS_CLIENTS - 1] != -1) {
+			close(mt->client[METRICS_CLIENTS - 1]);
+			mt->dropped++;
+		}
+		for (i = METRICS_CLIENTS - 1; i > 0; i--)
+			mt->client[i] = mt->client[i - 1];
+		mt->client[0] = fd;
+	}
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+	    errno != ECONNABORTED)
+		warn("accept");
+}
+
+/*
+ * The request is read and thrown away before answering it; closing a
+ * socket with unread data would reset the connection.
+ */
+static void
+metrics_reply(struct metrics *mt, int i)
+{
+	static struct page page;
+	char buf[1024];
+	int fd;
+
+	fd = mt->client[i];
+	for (; i < METRICS_CLIENTS - 1; i++)
+		mt->client[i] = mt->client[i + 1];
+	mt->client[i] = -1;
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	metrics_page(mt, &page);
+	if (write(fd, page.buf, page.len) != (ssize_t) page.len)
+		mt->dropped++;
+	else
+		mt->scrapes++;
+	close(fd);
+}
+
+static void
+metrics_page(struct metrics *mt, struct page *pg)
+{
+	struct reader_counts rc;
+	struct injector *inj = mt->inj;
+	struct layout *lt = &inj->layout;
+	int t;
+
+	/* With -T, the reader's counters are written by its own thread. */
+	if (mt->ring != NULL)
+		ring_counts(mt->ring, &rc);
+	else
+		reader_counts(mt->rd, &rc);
+
+	pg->len = 0;
+	put(pg, "HTTP/1.0 200 OK\r\n"
+	    "Content-Type: text/plain; version=0.0.4\r\n\r\n");
+
+	put(pg, "# TYPE xin_events_total counter\n");
+	for (t = 0; t < NTYPES; t++)
+		put(pg, "xin_events_total{type=\"%c\"} %llu\n",
+		    EVENT_TYPES[t], inj->events[t]);
+
+	counter(pg, "xin_read_bytes_total", rc.bytes);
+	counter(pg, "xin_reads_total", rc.reads);
+	counter(pg, "xin_lines_total", rc.lines);
+	counter(pg, "xin_bursts_total", rc.bursts);
+	counter(pg, "xin_parse_errors_total", rc.errors);
+	counter(pg, "xin_truncated_lines_total", rc.truncated);
+	counter(pg, "xin_motion_events_total", inj->motions);
+	counter(pg, "xin_motion_coalesced_total", inj->merged);
+	counter(pg, "xin_requests_total", inj->flush.requests);
+	counter(pg, "xin_flushes_total", inj->flush.flushes);
+	counter(pg, "xin_keymap_builds_total", inj->keymap.builds);
+	counter(pg, "xin_scratch_remaps_total", inj->keymap.remaps);
+	counter(pg, "xin_scratch_evictions_total", inj->keymap.evictions);
+
+	counter(pg, "xin_layout_switches_total", lt->switches);
+	counter(pg, "xin_layout_group_locks_total", lt->locks);
+	counter(pg, "xin_layout_fallbacks_total", lt->fallbacks);
+	counter(pg, "xin_layout_timeouts_total", lt->timeouts);
+	/* Loads, group locks and setxkbmap runs alike. */
+	put(pg, "# TYPE xin_layout_switch_seconds summary\n");
+	put(pg, "xin_layout_switch_seconds_sum %.6f\n", lt->total_ms / 1e3);
+	put(pg, "xin_layout_switch_seconds_count %llu\n", lt->mapped);
+	gauge(pg, "xin_layout_switch_seconds_max", lt->max_ms / 1e3);
+
+	gauge(pg, "xin_input_buffered_bytes", rc.buffered);
+	gauge(pg, "xin_pending_requests", inj->flush.pending);
+	gauge(pg, "xin_motion_pending", inj->motion_pending);
+	gauge(pg, "xin_layout_switch_pending", lt->pending);
+
+	if (mt->ring != NULL) {
+		gauge(pg, "xin_queue_depth", ring_depth(mt->ring));
+		gauge(pg, "xin_queue_max_depth", mt->ring->max_depth);
+		counter(pg, "xin_reader_stalls_total",
+		    __atomic_load_n(&mt->ring->stalls, __ATOMIC_RELAXED));
+		put(pg, "# TYPE xin_reader_stall_seconds_total counter\n"
+		    "xin_reader_stall_seconds_total %.6f\n",
+		    __atomic_load_n(&mt->ring->stall_ns, __ATOMIC_RELAXED) / 1e9);
+	}
+
+	if (inj->priority) {
+		counter(pg, "xin_priority_folded_total", inj->folded);
+		counter(pg, "xin_priority_requests_saved_total", inj->saved);
+		put(pg, "# TYPE xin_priority_saved_seconds_total counter\n"
+		    "xin_priority_saved_seconds_total %.6f\n",
+		    injector_saved(inj));
+	}
+
+	if (inj->focus.dpy != NULL) {
+		counter(pg, "xin_focus_queries_total", inj->focus.queries);
+		counter(pg, "xin_focus_changes_total", inj->focus.changes);
+	}
+	if (inj->tree.dpy != NULL) {
+		gauge(pg, "xin_window_tree_windows", inj->tree.windows);
+		counter(pg, "xin_window_tree_updates_total", inj->tree.updates);
+		counter(pg, "xin_window_tree_queries_total", inj->tree.queries);
+	}
+	if (inj->ptr.dpy != NULL) {
+		counter(pg, "xin_pointer_foreign_motion_total",
+		    inj->ptr.foreign);
+		counter(pg, "xin_pointer_queries_total", inj->ptr.queries);
+		counter(pg, "xin_pointer_drifts_total", inj->ptr.drifts);
+	}
+	if (inj->replay.events > 0) {
+		counter(pg, "xin_replay_events_total", inj->replay.events);
+		counter(pg, "xin_replay_late_total", inj->replay.late);
+		gauge(pg, "xin_replay_speed", inj->replay.speed);
+	}
+	counter(pg, "xin_metrics_scrapes_total", mt->scrapes);
+	counter(pg, "xin_metrics_dropped_total", mt->dropped);
+}
+
+/*
+ * Appends to the page. Output that does not fit is cut off.
+ */
+static void
+put(struct page *pg, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(&pg->buf[pg->len], sizeof(pg->buf) - pg->len, fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return;
+	pg->len += n;
+	if (pg->len >= sizeof(pg->buf))
+		pg->len = sizeof(pg->buf) - 1;
+}
+
+static void
+counter(struct page *pg, const char *name, unsigned long long v)
+{
+	put(pg, "# TYPE %s counter\n%s %llu\n", name, name, v);
+}
+
+static void
+gauge(struct page *pg, const char *name, double v)
+{
+	put(pg, "# TYPE %s gauge\n%s %g\n", name, name, v);
+}
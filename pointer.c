@@ -0,0 +1,234 @@
+/*
+ * xin - X11 forwarded input receiver
+ * Copyright (c) 2020 Tommi Leino <namhas@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Pointer position tracking.
+ *
+ * Motion is given to us relative, but injected as absolute positions
+ * computed from where we think the pointer is. When the user or another
+ * client moves the pointer, we would put it back where it was. To
+ * notice that, we select XI2 raw motion events on the root window,
+ * which are reported for every pointer device whatever window the
+ * pointer is in. Those of the XTEST device of our client pointer are
+ * ignored; any other raw motion means the pointer may have moved under
+ * us, and its position is asked through xcb. Raw events do not tell
+ * the client, so XTEST motion of another client through the same
+ * master pointer cannot be told from ours and is not followed. Raw motion during a grab, such as a
+ * drag, is only reported from XInput 2.1 on, and goes unnoticed with
+ * an older server.
+ *
+ * Only one question is out at a time, and it is answered in order with
+ * the motion we have sent, so the answer is compared to the position
+ * we had last sent when asking. Any difference is drift, and is added
+ * to our position, so that the motion after it continues from where the
+ * pointer really is. The answer is picked up whenever it has arrived;
+ * nothing waits for it.
+ *
+ * This needs our motion to go through the request stream, so it is not
+ * done with uinput, whose motion the server sees at its own pace, nor
+ * with SendEvent, which does not move the pointer at all.
+ */
+
+#include "xin.h"
+
+#include <X11/extensions/XInput2.h>
+#include <xcb/xcbext.h>
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void	pointer_query(struct injector *);
+
+void
+pointer_init(struct injector *inj)
+{
+	struct pointer *p = &inj->ptr;
+	XIEventMask em[2];
+	unsigned char raw[XIMaskLen(XI_LASTEVENT)];
+	unsigned char hier[XIMaskLen(XI_LASTEVENT)];
+	int event, error, major, minor;
+
+	memset(p, 0, sizeof(*p));
+	major = XI_MAJOR;
+	minor = XI_MINOR;
+	if (XQueryExtension(inj->dpy, "XInputExtension", &p->opcode, &event,
+	    &error) == False || XIQueryVersion(inj->dpy, &major,
+	    &minor) != Success) {
+		warnx("no XInput 2; pointer moved by others is not followed");
+		return;
+	}
+	p->dpy = inj->dpy;
+	p->conn = XGetXCBConnection(inj->dpy);
+
+	memset(raw, 0, sizeof(raw));
+	memset(hier, 0, sizeof(hier));
+	XISetMask(raw, XI_RawMotion);
+	XISetMask(hier, XI_HierarchyChanged);
+	em[0].deviceid = XIAllMasterDevices;
+	em[0].mask_len = sizeof(raw);
+	em[0].mask = raw;
+	em[1].deviceid = XIAllDevices;
+	em[1].mask_len = sizeof(hier);
+	em[1].mask = hier;
+	XISelectEvents(p->dpy, DefaultRootWindow(p->dpy), em, 2);
+
+	pointer_devices(p);
+}
+
+/*
+ * Returns 1 if the event was an XI2 event for us.
+ */
+int
+pointer_event(struct injector *inj, XEvent *e)
+{
+	struct pointer *p = &inj->ptr;
+	XIRawEvent *raw;
+
+	if (p->dpy == NULL || e->type != GenericEvent ||
+	    e->xcookie.extension != p->opcode)
+		return 0;
+	if (XGetEventData(p->dpy, &e->xcookie) == False)
+		return 1;
+
+	switch (e->xcookie.evtype) {
+	case XI_RawMotion:
+		raw = e->xcookie.data;
+		if (raw->sourceid != p->own) {
+			p->foreign++;
+			pointer_query(inj);
+		}
+		break;
+	case XI_HierarchyChanged:
+		pointer_devices(p);
+		break;
+	}
+	XFreeEventData(p->dpy, &e->xcookie);
+	return 1;
+}
+
+/*
+ * Takes the answer to the last question if it has arrived, and moves
+ * our idea of the pointer by the drift it shows.
+ */
+void
+pointer_sync(struct injector *inj)
+{
+	struct pointer *p = &inj->ptr;
+	xcb_query_pointer_reply_t *reply;
+	xcb_generic_error_t *error;
+	int dx, dy;
+
+	if (p->pending == 0)
+		return;
+	if (xcb_poll_for_reply(p->conn, p->cookie.sequence, (void **) &reply,
+	    &error) == 0)
+		return;
+
+	p->pending = 0;
+	if (reply != NULL && reply->same_screen && p->stale == 0) {
+		dx = reply->root_x - p->qx;
+		dy = reply->root_y - p->qy;
+		if (dx != 0 || dy != 0) {
+			inj->x += dx;
+			inj->y += dy;
+			p->drifts++;
+		}
+	}
+	p->stale = 0;
+	free(reply);
+	free(error);
+
+	if (p->again) {
+		p->again = 0;
+		pointer_query(inj);
+	}
+}
+
+/*
+ * After the pointer has been moved to an absolute position, whatever
+ * it had drifted before does not matter anymore.
+ */
+void
+pointer_warped(struct pointer *p)
+{
+	if (p->pending)
+		p->stale = 1;
+}
+
+void
+pointer_stats(struct pointer *p)
+{
+	if (p->dpy == NULL)
+		return;
+	warnx("pointer moved by others %llu times; asked %llu times, "
+	    "drifted %llu times", p->foreign, p->queries, p->drifts);
+}
+
+/*
+ * Asks where the pointer is, or if a question is already out, asks
+ * again once it has been answered.
+ */
+static void
+pointer_query(struct injector *inj)
+{
+	struct pointer *p = &inj->ptr;
+
+	if (inj->have_pointer == 0)
+		return;
+	if (p->pending) {
+		p->again = 1;
+		return;
+	}
+	p->cookie = xcb_query_pointer(p->conn, RootWindow(p->dpy, inj->screen));
+	xcb_flush(p->conn);
+	p->pending = 1;
+	p->qx = p->sx;
+	p->qy = p->sy;
+	p->queries++;
+}
+
+/*
+ * Finds the device our own input comes from, the XTEST pointer attached
+ * to our client pointer. Called again when the client pointer is set or
+ * the devices change.
+ */
+void
+pointer_devices(struct pointer *p)
+{
+	XIDeviceInfo *info;
+	size_t len, suffix;
+	int i, n, master;
+
+	p->own = -1;
+	if (p->dpy == NULL ||
+	    XIGetClientPointer(p->dpy, None, &master) == False ||
+	    (info = XIQueryDevice(p->dpy, XIAllDevices, &n)) == NULL)
+		return;
+	suffix = strlen(" XTEST pointer");
+	for (i = 0; i < n; i++) {
+		if (info[i].use != XISlavePointer ||
+		    info[i].attachment != master)
+			continue;
+		len = strlen(info[i].name);
+		if (len > suffix && strcmp(info[i].name + len - suffix,
+		    " XTEST pointer") == 0) {
+			p->own = info[i].deviceid;
+			break;
+		}
+	}
+	XIFreeDeviceInfo(info);
+}
@@ -0,0 +1,204 @@
+/*
+ * xin - X11 forwarded input receiver
+ * Copyright (c) 2020 Tommi Leino <namhas@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * End-to-end latency probe.
+ *
+ * A second connection records the device events the server processes
+ * with the RECORD extension. Every injected event is queued with the
+ * time its input was read from stdin, and when the server reports an
+ * event of the same type and detail, the oldest matching entry is
+ * taken off the queue and the difference counted into a histogram.
+ * Entries skipped over were never seen by the server, and reported
+ * events that match nothing came from elsewhere, such as a real mouse.
+ *
+ * The report time is when we process the recorded event, so the
+ * figures include our own delay in noticing it. Events injected with
+ * SendEvent are not device events and cannot be observed this way.
+ */
+
+#include "xin.h"
+
+#include <X11/extensions/record.h>
+#include <err.h>
+#include <stdlib.h>
+
+static void	probe_intercept(XPointer, XRecordInterceptData *);
+static void	probe_match(struct probe *, int, int);
+
+struct probe *
+probe_new(Display *dpy)
+{
+	struct probe *pr;
+	XRecordClientSpec clients;
+	XRecordRange *range;
+	int major, minor;
+
+	if ((pr = calloc(1, sizeof(*pr))) == NULL)
+		err(1, "calloc");
+	pr->dpy = dpy;
+	if ((pr->rdpy = XOpenDisplay(DisplayString(dpy))) == NULL)
+		errx(1, "probe: couldn't open a second connection");
+	if (XRecordQueryVersion(dpy, &major, &minor) == 0)
+		errx(1, "probe: RECORD extension not available");
+
+	if ((range = XRecordAllocRange()) == NULL)
+		err(1, "XRecordAllocRange");
+	range->device_events.first = KeyPress;
+	range->device_events.last = MotionNotify;
+	clients = XRecordAllClients;
+	pr->ctx = XRecordCreateContext(dpy, 0, &clients, 1, &range, 1);
+	XFree(range);
+	if (pr->ctx == 0)
+		errx(1, "probe: couldn't create a RECORD context");
+
+	/* The context must exist before the other connection uses it. */
+	XSync(dpy, False);
+	if (XRecordEnableContextAsync(pr->rdpy, pr->ctx, probe_intercept,
+	    (XPointer) pr) == 0)
+		errx(1, "probe: couldn't enable the RECORD context");
+	XFlush(pr->rdpy);
+	return pr;
+}
+
+int
+probe_fd(struct probe *pr)
+{
+	return pr != NULL ? ConnectionNumber(pr->rdpy) : -1;
+}
+
+/*
+ * Notes the time new input was read. It is the send time of the events
+ * injected from it.
+ */
+void
+probe_input(struct probe *pr)
+{
+	if (pr != NULL)
+		clock_gettime(CLOCK_MONOTONIC, &pr->input);
+}
+
+/*
+ * Queues an injected event, given as a core event type and detail.
+ */
+void
+probe_sent(struct probe *pr, int type, int detail)
+{
+	struct probe_entry *pe;
+
+	if (pr == NULL)
+		return;
+	if (pr->len == PROBE_QUEUE) {
+		pr->head = (pr->head + 1) % PROBE_QUEUE;
+		pr->len--;
+		pr->overflows++;
+	}
+	pe = &pr->queue[(pr->head + pr->len++) % PROBE_QUEUE];
+	pe->type = type;
+	pe->detail = detail;
+	pe->sent = pr->input;
+	pr->sent++;
+}
+
+void
+probe_process(struct probe *pr)
+{
+	XRecordProcessReplies(pr->rdpy);
+}
+
+/*
+ * Waits up to a second for the server to report what is still queued.
+ */
+void
+probe_finish(struct probe *pr)
+{
+	struct pollfd pfd;
+	struct timespec start, now;
+	long left;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pfd.fd = ConnectionNumber(pr->rdpy);
+	pfd.events = POLLIN;
+	while (pr->len > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		left = 1000 - ((now.tv_sec - start.tv_sec) * 1000 +
+		    (now.tv_nsec - start.tv_nsec) / 1000000);
+		if (left <= 0 || poll(&pfd, 1, left) <= 0)
+			break;
+		probe_process(pr);
+	}
+	pr->lost += pr->len;
+	pr->len = 0;
+
+	XRecordDisableContext(pr->dpy, pr->ctx);
+	XRecordFreeContext(pr->dpy, pr->ctx);
+	XFlush(pr->dpy);
+}
+
+void
+probe_stats(struct probe *pr)
+{
+	struct hist *h = &pr->hist;
+
+	warnx("probe: %llu events injected, %llu delivered, %llu lost, "
+	    "%llu foreign, %llu overflows", pr->sent, h->total, pr->lost,
+	    pr->foreign, pr->overflows);
+	if (h->total > 0)
+		warnx("probe: stdin to server %.1f us p50, %.1f us p99, "
+		    "%.1f us p99.9, %.1f us max",
+		    hist_percentile(h, 50) / 1e3, hist_percentile(h, 99) / 1e3,
+		    hist_percentile(h, 99.9) / 1e3, h->max / 1e3);
+}
+
+static void
+probe_intercept(XPointer arg, XRecordInterceptData *data)
+{
+	struct probe *pr = (struct probe *) arg;
+
+	if (data->category == XRecordFromServer && data->data_len > 0)
+		probe_match(pr, data->data[0] & 0x7f, data->data[1]);
+	XRecordFreeData(data);
+}
+
+static void
+probe_match(struct probe *pr, int type, int detail)
+{
+	struct probe_entry *pe;
+	struct timespec now;
+	long long ns;
+	int i;
+
+	for (i = 0; i < pr->len; i++) {
+		pe = &pr->queue[(pr->head + i) % PROBE_QUEUE];
+		if (pe->type == type && (type == MotionNotify ||
+		    pe->detail == detail))
+			break;
+	}
+	if (i == pr->len) {
+		pr->foreign++;
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ns = (now.tv_sec - pe->sent.tv_sec) * 1000000000LL +
+	    (now.tv_nsec - pe->sent.tv_nsec);
+	hist_add(&pr->hist, ns > 0 ? ns : 0);
+
+	pr->lost += i;
+	pr->head = (pr->head + i + 1) % PROBE_QUEUE;
+	pr->len -= i + 1;
+}
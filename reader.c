@@ -0,0 +1,547 @@
+/*
+ * xin - X11 forwarded input receiver
+ * Copyright (c) 2020 Tommi Leino <namhas@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Chunked stdin reader and tokenizer for the text protocol.
+ *
+ * Input is read with read() into a large buffer and all complete lines
+ * in it are tokenized in place, so that one system call yields many
+ * events. Layout names and texts are not copied; they point to the
+ * buffer and are valid until the next reader_fill(). The binary
+ * protocol shares the same buffer and is decoded in wire.c.
+ *
+ * A burst line stands for many events:
+ *
+ *	M dx dy [dx dy ...]	motion by each delta in turn
+ *	s keysym [keysym ...]	press and release of each keysym
+ *	c button		press and release of a button
+ *
+ * It is expanded into ordinary events once, in the reader's burst
+ * buffer, and handed out from there over as many calls as it takes.
+ * All but the last event of a burst are marked, so that the injector
+ * holds off the flush policy until the end of the burst and flushes it
+ * all at once.
+ *
+ * A "u text" line types the UTF-8 text after it. It is one event unless
+ * the text is too long for a ring entry; then it is split into a burst
+ * of texts at character boundaries. The pieces are kept in the reader,
+ * so a batch of events never holds more than one split text.
+ */
+
+#include "xin.h"
+
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+
+static size_t	text_parse(struct reader *, struct event *, size_t);
+static int	parse_int(char **, int *);
+static int	parse_prefix(char **, long long *);
+static int	parse_line(struct reader *, char *, size_t, struct event *);
+static int	parse_burst(struct reader *, char *, struct event *);
+static void	timespec_add_diff(struct timespec *, const struct timespec *,
+		    const struct timespec *);
+
+void
+reader_init(struct reader *rd, int fd, enum reader_mode mode)
+{
+	memset(rd, 0, sizeof(*rd));
+	rd->fd = fd;
+	rd->mode = mode;
+}
+
+/*
+ * Moves a partially read line to the beginning of the buffer and reads
+ * more. While events still point to the buffer, it is pinned and only
+ * the room after the input is filled. Returns the number of bytes read,
+ * 0 on end of file and -1 if the read would block or there is no room.
+ */
+int
+reader_fill(struct reader *rd)
+{
+	ssize_t n;
+
+	if (rd->start > 0 && rd->pinned == 0) {
+		memmove(rd->buf, &rd->buf[rd->start], rd->end - rd->start);
+		rd->end -= rd->start;
+		rd->start = 0;
+	}
+	if (rd->end == sizeof(rd->buf))
+		return -1;
+
+	do {
+		n = read(rd->fd, &rd->buf[rd->end], sizeof(rd->buf) - rd->end);
+	} while (n == -1 && errno == EINTR);
+
+	if (n == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return -1;
+		err(1, "reading stdin");
+	}
+	if (n == 0)
+		rd->eof = 1;
+
+	rd->reads++;
+	rd->bytes += n;
+	rd->end += n;
+	return n;
+}
+
+/*
+ * Returns 1 if reader_fill() may be called when input is ready.
+ */
+int
+reader_room(struct reader *rd)
+{
+	return rd->eof == 0 && (rd->pinned == 0 ||
+	    rd->end < sizeof(rd->buf));
+}
+
+/*
+ * Tokenizes up to nev events from complete lines or binary records
+ * in the buffer.
+ * Returns the number of events stored; 0 means that more input is
+ * needed.
+ */
+size_t
+reader_parse(struct reader *rd, struct event *ev, size_t nev)
+{
+	struct timespec t0, t1;
+	size_t n;
+
+	if (rd->sniffed == 0 && wire_sniff(rd) == 0)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	/*
+	 * What is left of a burst goes first, and what is left of a split
+	 * text alone, as the next one would overwrite its pieces.
+	 */
+	n = reader_burst_take(rd, ev, nev);
+	if (rd->ntext > 0) {
+		if (rd->nburst == 0)
+			rd->ntext = 0;
+		if (n > 0)
+			goto out;
+	}
+	if (rd->mode == READER_BINARY)
+		n += wire_parse(rd, &ev[n], nev - n);
+	else
+		n += text_parse(rd, &ev[n], nev - n);
+
+out:
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	timespec_add_diff(&rd->parse_time, &t1, &t0);
+	rd->events += n;
+	return n;
+}
+
+static size_t
+text_parse(struct reader *rd, struct event *ev, size_t nev)
+{
+	char *p, *nl;
+	size_t len, n;
+
+	n = 0;
+	while (n < nev && rd->start < rd->end) {
+		p = &rd->buf[rd->start];
+		len = rd->end - rd->start;
+
+		if ((nl = memchr(p, '\n', len)) == NULL) {
+			/*
+			 * Either the line is too long to ever fit, or it
+			 * was the last line and it ended without newline.
+			 */
+			if (len >= MAXLINE - 1 || rd->eof) {
+				if (rd->skip_truncated == 0) {
+					warnx("parse error; truncated input");
+					rd->truncated++;
+				}
+				rd->skip_truncated = !rd->eof;
+				rd->start = rd->end;
+			}
+			break;
+		}
+
+		len = nl - p;
+		rd->start += len + 1;
+		rd->lines++;
+
+		if (rd->skip_truncated) {
+			rd->skip_truncated = 0;
+			continue;
+		} else if (len >= MAXLINE - 1) {
+			warnx("parse error; truncated input");
+			rd->truncated++;
+			continue;
+		}
+
+		switch (parse_line(rd, p, len, &ev[n])) {
+		case 0:
+			n++;
+			break;
+		case 1:
+			n += reader_burst_take(rd, &ev[n], nev - n);
+			if (rd->ntext > 0)
+				return n;
+			break;
+		default:
+			rd->errors++;
+			break;
+		}
+	}
+	return n;
+}
+
+/*
+ * Adds an event to the burst being expanded, timed and routed like ev.
+ */
+void
+reader_burst_add(struct reader *rd, const struct event *ev, char type,
+    int v1, int v2)
+{
+	struct event *b;
+
+	if (rd->nburst > 0)
+		rd->burst[rd->nburst - 1].more = 1;
+	b = &rd->burst[rd->nburst++];
+	b->more = 0;
+	b->type = type;
+	b->v1 = v1;
+	b->v2 = v2;
+	b->v3 = -1;
+	b->str = NULL;
+	b->time = ev->time;
+	b->target = ev->target;
+}
+
+/*
+ * Splits a text into pieces of less than MAXSTR bytes, cut before a
+ * UTF-8 continuation byte where possible, and adds a 'u' event for each
+ * to the burst being expanded.
+ */
+void
+reader_burst_text(struct reader *rd, const struct event *ev,
+    const char *text, size_t len)
+{
+	char *s;
+	size_t n;
+
+	while (len > 0) {
+		n = len < MAXSTR - 1 ? len : MAXSTR - 1;
+		if (n < len)
+			while (n > MAXSTR - 4 && (text[n] & 0xc0) == 0x80)
+				n--;
+		s = &rd->text[rd->ntext];
+		memcpy(s, text, n);
+		s[n] = '\0';
+		rd->ntext += n + 1;
+
+		reader_burst_add(rd, ev, 'u', 0, 0);
+		rd->burst[rd->nburst - 1].str = s;
+		text += n;
+		len -= n;
+	}
+}
+
+/*
+ * Copies up to nev events of the current burst. Returns the number of
+ * events copied.
+ */
+size_t
+reader_burst_take(struct reader *rd, struct event *ev, size_t nev)
+{
+	size_t n;
+
+	n = rd->nburst - rd->burst_next;
+	if (n > nev)
+		n = nev;
+	memcpy(ev, &rd->burst[rd->burst_next], n * sizeof(*ev));
+	rd->burst_next += n;
+	if (rd->burst_next == rd->nburst)
+		rd->nburst = rd->burst_next = 0;
+	return n;
+}
+
+void
+reader_stats(struct reader *rd)
+{
+	double secs;
+
+	secs = rd->parse_time.tv_sec + rd->parse_time.tv_nsec / 1e9;
+
+	warnx("read %llu bytes in %llu reads; %llu lines, %llu events, "
+	    "%llu bursts, %llu errors, %llu truncated", rd->bytes, rd->reads,
+	    rd->lines, rd->events, rd->bursts, rd->errors, rd->truncated);
+	if (secs > 0 && rd->reads > 0)
+		warnx("parsed in %.3f ms; %.0f events/s, %.1f MB/s, "
+		    "%.1f events/read", secs * 1e3, rd->events / secs,
+		    rd->bytes / secs / 1e6, (double) rd->events / rd->reads);
+}
+
+void
+reader_counts(struct reader *rd, struct reader_counts *rc)
+{
+	rc->reads = rd->reads;
+	rc->bytes = rd->bytes;
+	rc->lines = rd->lines;
+	rc->bursts = rd->bursts;
+	rc->errors = rd->errors;
+	rc->truncated = rd->truncated;
+	rc->buffered = rd->end - rd->start;
+}
+
+/*
+ * Maps an event type to the index of its counters, or -1 if it is not
+ * a known type.
+ */
+int
+event_index(char type)
+{
+	const char *p;
+
+	if (type == '\0' || (p = strchr(EVENT_TYPES, type)) == NULL)
+		return -1;
+	return p - EVENT_TYPES;
+}
+
+/*
+ * Same as sscanf(" %d") would accept: optional leading white space,
+ * optional sign and at least one digit. Trailing garbage is ignored
+ * by the caller just like it was ignored by sscanf.
+ */
+static int
+parse_int(char **pp, int *v)
+{
+	char *p;
+	long n;
+	int neg;
+
+	p = *pp;
+	while (*p == ' ' || *p == '\t' || *p == '\v' || *p == '\f')
+		p++;
+
+	neg = 0;
+	if (*p == '-' || *p == '+')
+		neg = (*p++ == '-');
+	if (*p < '0' || *p > '9')
+		return -1;
+
+	for (n = 0; *p >= '0' && *p <= '9'; p++)
+		if (n <= INT_MAX)
+			n = n * 10 + (*p - '0');
+	if (n > INT_MAX)
+		n = INT_MAX;
+
+	*v = neg ? -n : n;
+	*pp = p;
+	return 0;
+}
+
+/*
+ * Parses the "@usec " prefix of a timestamped line or the ">id " prefix
+ * of a line for another target.
+ */
+static int
+parse_prefix(char **pp, long long *t)
+{
+	char *p;
+	long long n;
+
+	p = *pp + 1;
+	if (*p < '0' || *p > '9')
+		return -1;
+	for (n = 0; *p >= '0' && *p <= '9'; p++) {
+		if (n > (LLONG_MAX - 9) / 10)
+			return -1;
+		n = n * 10 + (*p - '0');
+	}
+	if (*p != ' ' && *p != '\t')
+		return -1;
+	while (*p == ' ' || *p == '\t')
+		p++;
+
+	*t = n;
+	*pp = p;
+	return 0;
+}
+
+/*
+ * Parses one line without its newline. The line is terminated in
+ * place so that a layout name or text can be referenced without
+ * copying.
+ * Returns 0 for an event stored in ev, 1 for a burst stored in the
+ * reader and -1 on error.
+ */
+static int
+parse_line(struct reader *rd, char *p, size_t len, struct event *ev)
+{
+	char *q, *end;
+	long long target;
+
+	if ((q = memchr(p, '\r', len)) != NULL)
+		len = q - p;
+	p[len] = '\0';
+	end = p + len;
+
+	ev->time = -1;
+	ev->target = 0;
+	ev->v3 = -1;
+	ev->more = 0;
+	for (;;) {
+		if (p[0] == '@') {
+			if (parse_prefix(&p, &ev->time) == -1) {
+				warnx("parse error; invalid timestamp");
+				return -1;
+			}
+		} else if (p[0] == '>') {
+			if (parse_prefix(&p, &target) == -1 ||
+			    target > INT_MAX) {
+				warnx("parse error; invalid target");
+				return -1;
+			}
+			ev->target = target;
+		} else
+			break;
+	}
+	len = end - p;
+
+	if ((p[0] == 'l' || p[0] == 'u') && len > 2) {
+		if (p[0] == 'u' && len - 2 >= MAXSTR) {
+			reader_burst_text(rd, ev, &p[2], len - 2);
+			return 1;
+		} else if (len - 2 >= MAXSTR) {
+			warnx("parse error; layout name too long");
+			return -1;
+		}
+		ev->type = p[0];
+		ev->str = &p[2];
+		return 0;
+	}
+	if (p[0] == 'M' || p[0] == 's' || p[0] == 'c')
+		return parse_burst(rd, p, ev);
+
+	ev->type = p[0];
+	ev->str = NULL;
+	q = p + 1;
+	if (len == 0 || parse_int(&q, &ev->v1) == -1) {
+		warnx("parse error; invalid or incomplete format");
+		return -1;
+	}
+	if (ev->type == 'k' || ev->type == 'K') {
+		ev->v2 = 0;
+		return 0;
+	}
+	if (parse_int(&q, &ev->v2) == -1) {
+		warnx("parse error; invalid or incomplete format");
+		return -1;
+	}
+
+	switch (ev->type) {
+	case 'm':
+	case 'b':
+	case 'B':
+		return 0;
+	case 'a':
+	case 'A':
+		/* The screen or monitor is optional. */
+		if (parse_int(&q, &ev->v3) == -1)
+			ev->v3 = -1;
+		else if (ev->v3 < 0) {
+			warnx("parse error; invalid screen or monitor");
+			return -1;
+		}
+		return 0;
+	default:
+		warnx("parse error; unknown control");
+		return -1;
+	}
+}
+
+/*
+ * Expands a burst line into the reader's burst buffer. Returns 1, or -1
+ * on error.
+ */
+static int
+parse_burst(struct reader *rd, char *p, struct event *ev)
+{
+	int v[2 * BURST_MAX];
+	char *q;
+	int i, n, max, extra;
+
+	switch (p[0]) {
+	case 'M':
+		max = 2 * BURST_MAX;
+		break;
+	case 's':
+		max = BURST_MAX;
+		break;
+	default:
+		max = 1;
+		break;
+	}
+
+	q = p + 1;
+	for (n = 0; n < max && parse_int(&q, &v[n]) == 0; n++)
+		;
+	if (n == 0 || (p[0] == 'M' && n % 2 != 0)) {
+		warnx("parse error; invalid or incomplete format");
+		return -1;
+	}
+	if (n == max && max > 1 && parse_int(&q, &extra) == 0) {
+		warnx("parse error; burst too long");
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		switch (p[0]) {
+		case 'M':
+			reader_burst_add(rd, ev, 'm', v[i], v[i + 1]);
+			i++;
+			break;
+		case 's':
+			reader_burst_add(rd, ev, 'k', v[i], 0);
+			reader_burst_add(rd, ev, 'K', v[i], 0);
+			break;
+		case 'c':
+			reader_burst_add(rd, ev, 'b', 0, v[i]);
+			reader_burst_add(rd, ev, 'B', 0, v[i]);
+			break;
+		}
+	}
+	rd->bursts++;
+	return 1;
+}
+
+static void
+timespec_add_diff(struct timespec *acc, const struct timespec *a,
+    const struct timespec *b)
+{
+	acc->tv_sec += a->tv_sec - b->tv_sec;
+	acc->tv_nsec += a->tv_nsec - b->tv_nsec;
+	while (acc->tv_nsec < 0) {
+		acc->tv_nsec += 1000000000L;
+		acc->tv_sec--;
+	}
+	while (acc->tv_nsec >= 1000000000L) {
+		acc->tv_nsec -= 1000000000L;
+		acc->tv_sec++;
+	}
+}
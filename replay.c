@@ -0,0 +1,138 @@
+/*
+ * xin - X11 forwarded input receiver
+ * Copyright (c) 2020 Tommi Leino <namhas@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Replay of timestamped streams.
+ *
+ * The first timestamped event is injected right away and fixes the
+ * mapping from stream time to CLOCK_MONOTONIC. Every later event has
+ * an absolute deadline computed from that mapping, so that time spent
+ * injecting or oversleeping does not accumulate into drift: a late event
+ * only shortens the wait before the next one.
+ *
+ * An event that is not due yet is not waited for here. The injector
+ * keeps it and polls with the time left as the timeout, so that X
+ * events, metrics clients and input are served during long gaps. Only
+ * the last millisecond, below what poll() can time, is slept through
+ * with clock_nanosleep(TIMER_ABSTIME).
+ */
+
+#include "xin.h"
+
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+
+static void	replay_deadline(struct replay *, long long, struct timespec *);
+
+void
+replay_init(struct replay *rp, double speed)
+{
+	rp->speed = speed;
+	rp->started = 0;
+	rp->events = 0;
+	rp->late = 0;
+	rp->jitter_sum = 0;
+	rp->jitter_max = 0;
+	rp->wait = 0;
+}
+
+/*
+ * Returns 1 if an event with the given stream time is due, and counts
+ * it. Otherwise sets rp->wait to the milliseconds left and returns 0.
+ */
+int
+replay_ready(struct replay *rp, long long t)
+{
+	struct timespec deadline, now;
+	long long left;
+	double jitter;
+	int r;
+
+	if (rp->speed == 0)
+		return 1;
+
+	replay_deadline(rp, t, &deadline);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	left = (deadline.tv_sec - now.tv_sec) * 1000000000LL +
+	    deadline.tv_nsec - now.tv_nsec;
+	if (left >= 1000000) {
+		rp->wait = left / 1000000 < INT_MAX ? left / 1000000 : INT_MAX;
+		return 0;
+	} else if (left > 0) {
+		while ((r = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+		    &deadline, NULL)) == EINTR)
+			;
+		if (r != 0) {
+			errno = r;
+			err(1, "clock_nanosleep");
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	}
+
+	jitter = (now.tv_sec - deadline.tv_sec) * 1e6 +
+	    (now.tv_nsec - deadline.tv_nsec) / 1e3;
+	rp->events++;
+	rp->jitter_sum += jitter;
+	if (jitter > rp->jitter_max)
+		rp->jitter_max = jitter;
+	if (jitter > 1000)
+		rp->late++;
+	return 1;
+}
+
+/*
+ * Reports the jitter of a paced replay; name is the target's with
+ * several targets, or NULL.
+ */
+void
+replay_stats(struct replay *rp, const char *name)
+{
+	if (rp->events == 0)
+		return;
+	warnx("%s%sreplayed %llu timestamped events at %gx speed; jitter "
+	    "%.1f us average, %.1f us max, %llu events over 1 ms late",
+	    name != NULL ? name : "", name != NULL ? ": " : "",
+	    rp->events, rp->speed, rp->jitter_sum / rp->events,
+	    rp->jitter_max, rp->late);
+}
+
+/*
+ * The first timestamped event fixes the mapping to the monotonic clock.
+ */
+static void
+replay_deadline(struct replay *rp, long long t, struct timespec *deadline)
+{
+	long long offset;
+
+	if (rp->started == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &rp->base);
+		rp->t0 = t;
+		rp->started = 1;
+	}
+
+	/* Stream time may not go backwards. */
+	if (t < rp->t0)
+		t = rp->t0;
+	offset = (long long) ((t - rp->t0) * 1000 / rp->speed);
+	deadline->tv_sec = rp->base.tv_sec + offset / 1000000000LL;
+	deadline->tv_nsec = rp->base.tv_nsec + offset % 1000000000LL;
+	if (deadline->tv_nsec >= 1000000000L) {
+		deadline->tv_nsec -= 1000000000L;
+		deadline->tv_sec++;
+	}
+}
@@ -0,0 +1,452 @@
+/*
+ * xin - X11 forwarded input receiver
+ * Copyright (c) 2020 Tommi Leino <namhas@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Reader thread and the event ring between it and the injector.
+ *
+ * With -T, stdin is read and parsed by a thread of its own, so that
+ * waiting for the X server never keeps the pipe from our forwarder
+ * from being drained. Parsed events are passed to the main thread,
+ * which alone uses the Display, through a bounded single producer,
+ * single consumer ring. Each side owns one index and only reads the
+ * other's, so no locks are needed; the consumer gives back space in
+ * batches to keep the cache line traffic down.
+ *
+ * A side that runs out of work sleeps in poll() on a pipe, after
+ * announcing it with a flag. The other side swaps the flag back and
+ * writes a byte only when the flag was set, so in a steady stream no
+ * wakeups are written at all. Both the flag and the index are accessed
+ * sequentially consistently, which makes sure that either the sleeper
+ * sees the new index or the waker sees the flag.
+ *
+ * The producer is either the reader thread started here, or with
+ * several displays the main thread feeding one ring per display; it may
+ * give up waiting for room after a while so that one slow display does
+ * not hold back the others.
+ *
+ * For the priority lane, the producer also counts the events other than
+ * motion it has pushed, and the consumer those it has taken, so that the
+ * injector knows whether a key or button event is queued behind the
+ * motion it is looking at.
+ *
+ * The reader counts in its own fields, which no other thread touches
+ * until it has been joined. After each round of reading and parsing, it
+ * copies them into the ring with atomic stores, and the metrics page
+ * reads that copy with atomic loads; it is at most one round behind.
+ * Likewise with -H, parse times go to histograms of the reader's own,
+ * which are added to the injector's only after the join, so that a
+ * dump on SIGUSR1 during the run leaves the parse stage out.
+ */
+
+#include "xin.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define load(p)		__atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define store(p, v)	__atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define swap(p, v)	__atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define count(p, v)	__atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+
+static void	*ring_reader(void *);
+static void	 ring_publish(struct ring *, unsigned long);
+static int	 ring_stall(struct ring *, unsigned long, long);
+static void	 ring_release(struct ring *);
+static void	 ring_publish_counts(struct ring *);
+static void	 ring_wake(int, int *);
+static void	 ring_drain(int);
+
+void
+ring_init(struct ring *rg)
+{
+	int i;
+
+	memset(rg, 0, sizeof(*rg));
+	if ((rg->buf = calloc(RING_SIZE, sizeof(*rg->buf))) == NULL)
+		err(1, "calloc");
+	if (pipe(rg->wake) == -1 || pipe(rg->space) == -1)
+		err(1, "pipe");
+	for (i = 0; i < 2; i++)
+		if (fcntl(rg->wake[i], F_SETFL, O_NONBLOCK) == -1 ||
+		    fcntl(rg->space[i], F_SETFL, O_NONBLOCK) == -1)
+			err(1, "fcntl");
+}
+
+/*
+ * Starts a thread reading rd into the ring.
+ */
+void
+ring_start(struct ring *rg, struct reader *rd, struct latency *lt)
+{
+	rg->rd = rd;
+	rg->into = lt;
+	rg->latency = lt != NULL ? latency_new() : NULL;
+	thread_start(&rg->thread, ring_reader, rg);
+}
+
+/*
+ * Waits for the reader thread, and adds the parse times it has
+ * recorded in histograms of its own to the injector's.
+ */
+void
+ring_join(struct ring *rg)
+{
+	pthread_join(rg->thread, NULL);
+	if (rg->latency != NULL) {
+		latency_merge(rg->into, rg->latency);
+		free(rg->latency);
+		rg->latency = NULL;
+	}
+}
+
+/*
+ * Starts a thread. Signals are left to the main thread.
+ */
+void
+thread_start(pthread_t *thread, void *(*fn)(void *), void *arg)
+{
+	sigset_t all, old;
+	int r;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	if ((r = pthread_create(thread, NULL, fn, arg)) != 0) {
+		errno = r;
+		err(1, "pthread_create");
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * The descriptor that becomes readable when events arrive while the
+ * injector is asleep.
+ */
+int
+ring_fd(struct ring *rg)
+{
+	return rg->wake[0];
+}
+
+/*
+ * Returns the next event, or NULL if there are none right now. The
+ * entry stays valid until the next call.
+ */
+struct ring_entry *
+ring_next(struct ring *rg)
+{
+	struct ring_entry *re;
+	unsigned long depth;
+
+	if (rg->next - rg->head >= RING_BATCH)
+		ring_release(rg);
+	if (rg->next == rg->avail) {
+		ring_release(rg);
+		rg->avail = load(&rg->tail);
+		if (rg->next == rg->avail)
+			return NULL;
+		if ((depth = rg->avail - rg->next) > rg->max_depth)
+			rg->max_depth = depth;
+	}
+	re = &rg->buf[rg->next++ & (RING_SIZE - 1)];
+	if (!IS_MOTION(re->ev.type))
+		rg->taken++;
+	return re;
+}
+
+/*
+ * Returns 1 if there is nothing to do and the injector may sleep. It
+ * will then be woken through ring_fd().
+ */
+int
+ring_idle(struct ring *rg)
+{
+	if (rg->next != rg->avail)
+		return 0;
+	store(&rg->sleeping, 1);
+	if (load(&rg->tail) != rg->next || load(&rg->eof)) {
+		store(&rg->sleeping, 0);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Called after poll() with the events of ring_fd().
+ */
+void
+ring_woken(struct ring *rg, short revents)
+{
+	store(&rg->sleeping, 0);
+	if (revents & POLLIN)
+		ring_drain(rg->wake[0]);
+}
+
+/*
+ * Returns 1 when the reader is done and everything has been taken.
+ */
+int
+ring_eof(struct ring *rg)
+{
+	return load(&rg->eof) && load(&rg->tail) == rg->next;
+}
+
+unsigned long
+ring_depth(struct ring *rg)
+{
+	return load(&rg->tail) - rg->next;
+}
+
+/*
+ * Returns the number of events other than motion queued after the ones
+ * taken so far.
+ */
+unsigned long
+ring_ahead(struct ring *rg)
+{
+	return load(&rg->discrete) - rg->taken;
+}
+
+/*
+ * Copies the reader's counters for another thread; for metrics.
+ */
+void
+ring_counts(struct ring *rg, struct reader_counts *rc)
+{
+	rc->reads = __atomic_load_n(&rg->counts.reads, __ATOMIC_RELAXED);
+	rc->bytes = __atomic_load_n(&rg->counts.bytes, __ATOMIC_RELAXED);
+	rc->lines = __atomic_load_n(&rg->counts.lines, __ATOMIC_RELAXED);
+	rc->bursts = __atomic_load_n(&rg->counts.bursts, __ATOMIC_RELAXED);
+	rc->errors = __atomic_load_n(&rg->counts.errors, __ATOMIC_RELAXED);
+	rc->truncated = __atomic_load_n(&rg->counts.truncated,
+	    __ATOMIC_RELAXED);
+	rc->buffered = __atomic_load_n(&rg->counts.buffered,
+	    __ATOMIC_RELAXED);
+}
+
+void
+ring_stats(struct ring *rg)
+{
+	warnx("event ring max depth %lu of %d; reader stalled %llu times "
+	    "for %.3f ms", rg->max_depth, RING_SIZE, load(&rg->stalls),
+	    load(&rg->stall_ns) / 1e6);
+}
+
+static void *
+ring_reader(void *arg)
+{
+	struct ring *rg = arg;
+	struct reader *rd = rg->rd;
+	struct event ev[256];
+	struct timespec stamp, t0;
+	struct pollfd pfd;
+	size_t n;
+	int nread;
+
+	nread = -1;
+	pfd.fd = rd->fd;
+	pfd.events = POLLIN;
+	do {
+		if (poll(&pfd, 1, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+		nread = reader_fill(rd);
+		clock_gettime(CLOCK_MONOTONIC, &stamp);
+		for (;;) {
+			latency_mark(rg->latency, &t0);
+			if ((n = reader_parse(rd, ev,
+			    sizeof(ev) / sizeof(ev[0]))) == 0)
+				break;
+			latency_parsed(rg->latency, &t0, ev, n);
+			ring_push(rg, ev, n, &stamp, -1);
+		}
+		ring_publish_counts(rg);
+	} while (nread != 0);
+
+	ring_close(rg);
+	return NULL;
+}
+
+/*
+ * Copies events into the ring, waiting for space if it is full, but
+ * no longer than wait milliseconds unless wait is negative. Layout
+ * names and texts are copied too, as the read buffer is about to be
+ * reused.
+ * Returns the number of events copied.
+ */
+size_t
+ring_push(struct ring *rg, struct event *ev, size_t n,
+    const struct timespec *stamp, long wait)
+{
+	struct ring_entry *re;
+	unsigned long tail, room, discrete;
+	size_t i;
+
+	tail = rg->tail;
+	discrete = rg->discrete;
+	for (i = 0; i < n; ) {
+		room = RING_SIZE - (tail - load(&rg->head));
+		if (room == 0) {
+			store(&rg->discrete, discrete);
+			ring_publish(rg, tail);
+			if (ring_stall(rg, tail, wait) == 0)
+				break;
+			continue;
+		}
+		for (; room > 0 && i < n; room--, i++, tail++) {
+			re = &rg->buf[tail & (RING_SIZE - 1)];
+			re->ev = ev[i];
+			re->stamp = *stamp;
+			if (!IS_MOTION(ev[i].type))
+				discrete++;
+			if (ev[i].str != NULL) {
+				snprintf(re->str, sizeof(re->str), "%s",
+				    ev[i].str);
+				re->ev.str = re->str;
+			}
+		}
+	}
+	store(&rg->discrete, discrete);
+	ring_publish(rg, tail);
+	return i;
+}
+
+/*
+ * Tells the consumer that nothing more is coming.
+ */
+void
+ring_close(struct ring *rg)
+{
+	store(&rg->eof, 1);
+	ring_wake(rg->wake[1], &rg->sleeping);
+}
+
+/*
+ * Returns 1 if the consumer has taken everything; for the producer.
+ */
+int
+ring_drained(struct ring *rg)
+{
+	return load(&rg->head) == rg->tail;
+}
+
+static void
+ring_publish(struct ring *rg, unsigned long tail)
+{
+	if (tail == rg->tail)
+		return;
+	store(&rg->tail, tail);
+	ring_wake(rg->wake[1], &rg->sleeping);
+}
+
+/*
+ * Waits until the consumer has made room, or for wait milliseconds.
+ * Returns 0 if there is still no room.
+ */
+static int
+ring_stall(struct ring *rg, unsigned long tail, long wait)
+{
+	struct timespec t0, t1;
+	struct pollfd pfd;
+	long long ns;
+	int room, timeout;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	pfd.fd = rg->space[0];
+	pfd.events = POLLIN;
+	timeout = wait;
+	for (;;) {
+		store(&rg->waiting, 1);
+		room = tail - load(&rg->head) < RING_SIZE;
+		if (room || timeout == 0)
+			break;
+		if (poll(&pfd, 1, timeout) == -1 && errno != EINTR)
+			err(1, "poll");
+		ring_drain(rg->space[0]);
+		if (wait >= 0) {
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			ns = (t1.tv_sec - t0.tv_sec) * 1000000000LL +
+			    t1.tv_nsec - t0.tv_nsec;
+			timeout = ns < wait * 1000000LL ?
+			    wait - ns / 1000000 : 0;
+		}
+	}
+	store(&rg->waiting, 0);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	count(&rg->stalls, 1);
+	count(&rg->stall_ns, (t1.tv_sec - t0.tv_sec) * 1000000000ULL +
+	    t1.tv_nsec - t0.tv_nsec);
+	return room;
+}
+
+/*
+ * Gives the entries taken so far back to the reader.
+ */
+static void
+ring_release(struct ring *rg)
+{
+	if (rg->next == rg->head)
+		return;
+	store(&rg->head, rg->next);
+	ring_wake(rg->space[1], &rg->waiting);
+}
+
+/*
+ * Copies the reader's counters where the injector thread may read them.
+ * The reader goes on counting in its own, unshared fields.
+ */
+static void
+ring_publish_counts(struct ring *rg)
+{
+	struct reader_counts rc;
+
+	reader_counts(rg->rd, &rc);
+	__atomic_store_n(&rg->counts.reads, rc.reads, __ATOMIC_RELAXED);
+	__atomic_store_n(&rg->counts.bytes, rc.bytes, __ATOMIC_RELAXED);
+	__atomic_store_n(&rg->counts.lines, rc.lines, __ATOMIC_RELAXED);
+	__atomic_store_n(&rg->counts.bursts, rc.bursts, __ATOMIC_RELAXED);
+	__atomic_store_n(&rg->counts.errors, rc.errors, __ATOMIC_RELAXED);
+	__atomic_store_n(&rg->counts.truncated, rc.truncated,
+	    __ATOMIC_RELAXED);
+	__atomic_store_n(&rg->counts.buffered, rc.buffered,
+	    __ATOMIC_RELAXED);
+}
+
+static void
+ring_wake(int fd, int *flag)
+{
+	if (swap(flag, 0) == 1)
+		while (write(fd, "", 1) == -1 && errno == EINTR)
+			;
+}
+
+static void
+ring_drain(int fd)
+{
+	char buf[64];
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+}
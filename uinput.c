@@ -0,0 +1,300 @@
+/*
+ * xin - X11 forwarded input receiver
+ * Copyright (c) 2020 Tommi Leino <namhas@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Injection through a Linux uinput device.
+ *
+ * Instead of asking the X server to fake input, a virtual input device
+ * is created with /dev/uinput and the events are written to it, so that
+ * they enter the server through its input driver like those of a real
+ * keyboard and mouse, without going through its request queue. The
+ * device is a keyboard and an absolute pointer in one, so that all the
+ * events of a flush go out with a single write().
+ *
+ * Keysyms are resolved to keycodes with the XKB keymap as usual; the X
+ * keycode of an evdev key is its evdev code plus 8. Pointer positions
+ * are scaled to the absolute axis range, which the server maps back to
+ * the whole root window. The initial pointer position is still asked
+ * from the X server.
+ *
+ * The device is seen by everything reading input on this machine, not
+ * only the display we are connected to, and the X server needs a moment
+ * to add it after it has been created, which is waited for at startup.
+ */
+
+#include "xin.h"
+
+#include <err.h>
+
+#ifdef __linux__
+
+#include <sys/ioctl.h>
+#include <linux/uinput.h>
+#include <X11/extensions/XInput2.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define UINPUT_NAME	"xin virtual input"
+#define UINPUT_MAXABS	65535
+#define UINPUT_EVENTS	1024
+
+struct uinput_state {
+	int			 fd;
+	struct input_event	 ev[UINPUT_EVENTS];
+	size_t			 n;
+};
+
+static void	ui_init(struct injector *);
+static void	ui_key(struct injector *, KeyCode, unsigned int, Bool);
+static void	ui_button(struct injector *, unsigned int, Bool);
+static void	ui_motion(struct injector *, int, int, int);
+static void	ui_pointer(struct injector *, int *, int *);
+static void	ui_flush(struct injector *);
+static void	ui_put(struct uinput_state *, int, int, int);
+static void	ui_write(struct uinput_state *);
+static void	ui_wait(struct injector *);
+
+const struct backend uinput_backend = {
+	"uinput",
+	ui_init,
+	ui_key,
+	ui_button,
+	ui_motion,
+	ui_pointer,
+	ui_flush
+};
+
+/*
+ * Buttons 1-3 and 8-9 are buttons of the device, and 4-7 are its wheels.
+ */
+static const int buttons[] = {
+	0, BTN_LEFT, BTN_MIDDLE, BTN_RIGHT, 0, 0, 0, 0, BTN_SIDE, BTN_EXTRA
+};
+
+static void
+ui_init(struct injector *inj)
+{
+	struct uinput_state *us;
+	struct uinput_setup setup;
+	struct uinput_abs_setup abs;
+	int i;
+
+	if ((us = calloc(1, sizeof(*us))) == NULL)
+		err(1, "calloc");
+	if ((us->fd = open("/dev/uinput", O_WRONLY)) == -1)
+		err(1, "/dev/uinput");
+
+	if (ioctl(us->fd, UI_SET_EVBIT, EV_KEY) == -1 ||
+	    ioctl(us->fd, UI_SET_EVBIT, EV_REL) == -1 ||
+	    ioctl(us->fd, UI_SET_EVBIT, EV_ABS) == -1 ||
+	    ioctl(us->fd, UI_SET_EVBIT, EV_SYN) == -1)
+		err(1, "UI_SET_EVBIT");
+	for (i = KEY_ESC; i < 248; i++)
+		if (ioctl(us->fd, UI_SET_KEYBIT, i) == -1)
+			err(1, "UI_SET_KEYBIT");
+	for (i = 0; i < (int) (sizeof(buttons) / sizeof(buttons[0])); i++)
+		if (buttons[i] != 0 &&
+		    ioctl(us->fd, UI_SET_KEYBIT, buttons[i]) == -1)
+			err(1, "UI_SET_KEYBIT");
+	if (ioctl(us->fd, UI_SET_RELBIT, REL_WHEEL) == -1 ||
+	    ioctl(us->fd, UI_SET_RELBIT, REL_HWHEEL) == -1)
+		err(1, "UI_SET_RELBIT");
+
+	memset(&abs, 0, sizeof(abs));
+	abs.absinfo.maximum = UINPUT_MAXABS;
+	abs.code = ABS_X;
+	if (ioctl(us->fd, UI_SET_ABSBIT, ABS_X) == -1 ||
+	    ioctl(us->fd, UI_ABS_SETUP, &abs) == -1)
+		err(1, "UI_ABS_SETUP");
+	abs.code = ABS_Y;
+	if (ioctl(us->fd, UI_SET_ABSBIT, ABS_Y) == -1 ||
+	    ioctl(us->fd, UI_ABS_SETUP, &abs) == -1)
+		err(1, "UI_ABS_SETUP");
+
+	memset(&setup, 0, sizeof(setup));
+	setup.id.bustype = BUS_VIRTUAL;
+	setup.id.vendor = 0x1;
+	setup.id.product = 0x1;
+	strncpy(setup.name, UINPUT_NAME, UINPUT_MAX_NAME_SIZE - 1);
+	if (ioctl(us->fd, UI_DEV_SETUP, &setup) == -1 ||
+	    ioctl(us->fd, UI_DEV_CREATE) == -1)
+		err(1, "couldn't create the uinput device");
+
+	inj->priv = us;
+	ui_wait(inj);
+}
+
+static void
+ui_key(struct injector *inj, KeyCode keycode, unsigned int mods,
+    Bool is_press)
+{
+	struct uinput_state *us = inj->priv;
+
+	if (keycode < 8)
+		return;
+	ui_put(us, EV_KEY, keycode - 8, is_press);
+	ui_put(us, EV_SYN, SYN_REPORT, 0);
+}
+
+static void
+ui_button(struct injector *inj, unsigned int button, Bool is_press)
+{
+	struct uinput_state *us = inj->priv;
+
+	if (button >= 4 && button <= 7) {
+		/* A wheel click is both a press and a release in X. */
+		if (is_press == False)
+			return;
+		if (button <= 5)
+			ui_put(us, EV_REL, REL_WHEEL, button == 4 ? 1 : -1);
+		else
+			ui_put(us, EV_REL, REL_HWHEEL, button == 6 ? -1 : 1);
+	} else if (button < sizeof(buttons) / sizeof(buttons[0]) &&
+	    buttons[button] != 0)
+		ui_put(us, EV_KEY, buttons[button], is_press);
+	else
+		return;
+	ui_put(us, EV_SYN, SYN_REPORT, 0);
+}
+
+static void
+ui_motion(struct injector *inj, int screen, int x, int y)
+{
+	struct uinput_state *us = inj->priv;
+	long w, h;
+
+	w = DisplayWidth(inj->dpy, screen) - 1;
+	h = DisplayHeight(inj->dpy, screen) - 1;
+	if (w < 1 || h < 1)
+		return;
+	ui_put(us, EV_ABS, ABS_X, (x * (long) UINPUT_MAXABS + w / 2) / w);
+	ui_put(us, EV_ABS, ABS_Y, (y * (long) UINPUT_MAXABS + h / 2) / h);
+	ui_put(us, EV_SYN, SYN_REPORT, 0);
+}
+
+static void
+ui_pointer(struct injector *inj, int *x, int *y)
+{
+	Window root, child;
+	int wx, wy;
+	unsigned int mask;
+
+	*x = *y = 0;
+	if (XQueryPointer(inj->dpy, DefaultRootWindow(inj->dpy), &root,
+	    &child, x, y, &wx, &wy, &mask) == False)
+		warnx("couldn't query initial pointer position");
+}
+
+static void
+ui_flush(struct injector *inj)
+{
+	ui_write(inj->priv);
+}
+
+/*
+ * Events are only buffered here; the kernel stamps them when written.
+ */
+static void
+ui_put(struct uinput_state *us, int type, int code, int value)
+{
+	struct input_event *ie;
+
+	if (us->n == UINPUT_EVENTS)
+		ui_write(us);
+	ie = &us->ev[us->n++];
+	memset(ie, 0, sizeof(*ie));
+	ie->type = type;
+	ie->code = code;
+	ie->value = value;
+}
+
+static void
+ui_write(struct uinput_state *us)
+{
+	char *p;
+	size_t len;
+	ssize_t n;
+
+	p = (char *) us->ev;
+	len = us->n * sizeof(us->ev[0]);
+	while (len > 0) {
+		if ((n = write(us->fd, p, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "uinput write");
+		}
+		p += n;
+		len -= n;
+	}
+	us->n = 0;
+}
+
+/*
+ * Waits up to two seconds for the X server to add the device, as input
+ * written before that is lost.
+ */
+static void
+ui_wait(struct injector *inj)
+{
+	struct timespec delay = { 0, 50000000L };
+	XIDeviceInfo *info;
+	int i, n, tries, major, minor, opcode, event, error;
+
+	major = XI_MAJOR;
+	minor = XI_MINOR;
+	if (XQueryExtension(inj->dpy, "XInputExtension", &opcode, &event,
+	    &error) == False || XIQueryVersion(inj->dpy, &major,
+	    &minor) != Success) {
+		nanosleep(&delay, NULL);
+		return;
+	}
+	for (tries = 0; tries < 40; tries++) {
+		if ((info = XIQueryDevice(inj->dpy, XIAllDevices, &n)) !=
+		    NULL) {
+			for (i = 0; i < n; i++)
+				if (strcmp(info[i].name, UINPUT_NAME) == 0)
+					break;
+			XIFreeDeviceInfo(info);
+			if (i < n)
+				return;
+		}
+		nanosleep(&delay, NULL);
+	}
+	warnx("uinput device did not show up on the display; its input "
+	    "goes elsewhere");
+}
+
+#else
+
+static void	ui_init(struct injector *);
+
+const struct backend uinput_backend = {
+	"uinput",
+	ui_init
+};
+
+static void
+ui_init(struct injector *inj)
+{
+	errx(1, "uinput is only available on Linux");
+}
+
+#endif
@@ -0,0 +1,463 @@
+/*
+ * xin - X11 forwarded input receiver
+ * Copyright (c) 2020 Tommi Leino <namhas@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Window tree cache for SendEvent pointer injection.
+ *
+ * Button and motion events sent with SendEvent must be addressed to the
+ * window under the pointer, with coordinates relative to it. Instead of
+ * asking the server with XQueryPointer or XTranslateCoordinates for
+ * every event, we keep a copy of the window tree: every window is
+ * selected for SubstructureNotify, and the create, destroy, map, unmap,
+ * configure, reparent, gravity and circulate events of its children
+ * keep the copy up to date. The window under the pointer is then found
+ * by walking down the mapped children from the top of the stack.
+ *
+ * The tree is read once at startup. Windows that show up later with
+ * children of their own, or whose geometry we have not seen, are asked
+ * about through xcb and the replies are picked up whenever they have
+ * arrived, in the same way as the input focus is. Replies never
+ * overwrite what an event has already told us.
+ *
+ * Input shapes are not taken into account.
+ */
+
+#include "xin.h"
+
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
+#include <err.h>
+#include <stdlib.h>
+
+#define WINTREE_BUCKETS	1024
+
+enum {
+	WQ_TREE,
+	WQ_GEOMETRY,
+	WQ_ATTRIBUTES
+};
+
+static struct winnode *node_find(struct wintree *, Window);
+static struct winnode *node_add(struct wintree *, struct winnode *, Window);
+static void	node_remove(struct wintree *, struct winnode *);
+static void	node_unlink(struct winnode *);
+static void	node_stack(struct winnode *, struct winnode *,
+		    struct winnode *);
+static void	wintree_watch(struct wintree *, struct winnode *, int);
+static void	wintree_query(struct wintree *, int, Window, unsigned int);
+static void	wintree_poll(struct wintree *, int);
+static void	wintree_reply(struct wintree *, struct winquery *, void *);
+
+void
+wintree_init(struct wintree *wt, Display *dpy, struct focus *focus)
+{
+	Window root;
+
+	wt->dpy = dpy;
+	wt->conn = XGetXCBConnection(dpy);
+	wt->focus = focus;
+	if ((wt->hash = calloc(WINTREE_BUCKETS, sizeof(*wt->hash))) == NULL)
+		err(1, "calloc");
+	wt->q = NULL;
+	wt->qhead = wt->qlen = wt->qsize = 0;
+	wt->under = None;
+	wt->grab = None;
+	wt->windows = 0;
+	wt->updates = 0;
+	wt->queries = 0;
+
+	root = RootWindow(dpy, 0);
+	wt->root = node_add(wt, NULL, root);
+	wt->root->mapped = wt->root->placed = wt->root->map_known = 1;
+	select_input(dpy, root, SubstructureNotifyMask);
+
+	/* The initial tree is the only one that is waited for. */
+	wintree_query(wt, WQ_TREE, root, xcb_query_tree(wt->conn,
+	    root).sequence);
+	wintree_poll(wt, 1);
+}
+
+/*
+ * Returns 1 if the event was about the window tree.
+ */
+int
+wintree_event(struct wintree *wt, XEvent *e)
+{
+	struct winnode *n, *p, *s;
+
+	if (wt->dpy == NULL || e->xany.send_event)
+		return 0;
+
+	switch (e->type) {
+	case CreateNotify:
+		if ((p = node_find(wt, e->xcreatewindow.parent)) == NULL)
+			return 1;
+		if ((n = node_find(wt, e->xcreatewindow.window)) == NULL) {
+			n = node_add(wt, p, e->xcreatewindow.window);
+			n->map_known = 1;
+			wintree_watch(wt, n, 0);
+		}
+		n->x = e->xcreatewindow.x;
+		n->y = e->xcreatewindow.y;
+		n->w = e->xcreatewindow.width;
+		n->h = e->xcreatewindow.height;
+		n->bw = e->xcreatewindow.border_width;
+		n->placed = 1;
+		break;
+	case DestroyNotify:
+		if ((n = node_find(wt, e->xdestroywindow.window)) == NULL ||
+		    n == wt->root)
+			return 1;
+		node_remove(wt, n);
+		break;
+	case MapNotify:
+	case UnmapNotify:
+		if ((n = node_find(wt, e->xmap.window)) == NULL)
+			return 1;
+		n->mapped = (e->type == MapNotify);
+		n->map_known = 1;
+		break;
+	case ConfigureNotify:
+		if ((n = node_find(wt, e->xconfigure.window)) == NULL ||
+		    n == wt->root)
+			return 0;
+		n->x = e->xconfigure.x;
+		n->y = e->xconfigure.y;
+		n->w = e->xconfigure.width;
+		n->h = e->xconfigure.height;
+		n->bw = e->xconfigure.border_width;
+		n->placed = 1;
+		s = node_find(wt, e->xconfigure.above);
+		if ((p = n->parent) == NULL || s == n)
+			break;
+		if (s != NULL && s->parent == p) {
+			node_unlink(n);
+			node_stack(n, p, s);
+		} else if (e->xconfigure.above == None) {
+			node_unlink(n);
+			node_stack(n, p, NULL);
+		}
+		break;
+	case ReparentNotify:
+		n = node_find(wt, e->xreparent.window);
+		p = node_find(wt, e->xreparent.parent);
+		if (p == NULL) {
+			if (n != NULL)
+				node_remove(wt, n);
+			return 1;
+		}
+		if (n == NULL) {
+			n = node_add(wt, p, e->xreparent.window);
+			wintree_watch(wt, n, 1);
+		} else if (n->parent != p) {
+			node_unlink(n);
+			node_stack(n, p, p->top);
+		}
+		n->x = e->xreparent.x;
+		n->y = e->xreparent.y;
+		break;
+	case GravityNotify:
+		if ((n = node_find(wt, e->xgravity.window)) == NULL)
+			return 1;
+		n->x = e->xgravity.x;
+		n->y = e->xgravity.y;
+		break;
+	case CirculateNotify:
+		if ((n = node_find(wt, e->xcirculate.window)) == NULL ||
+		    (p = n->parent) == NULL)
+			return 1;
+		node_unlink(n);
+		node_stack(n, p, e->xcirculate.place == PlaceOnTop ? p->top :
+		    NULL);
+		break;
+	default:
+		return 0;
+	}
+	wt->updates++;
+	return 1;
+}
+
+/*
+ * Returns the deepest mapped window containing the point given in root
+ * coordinates, and the point relative to it.
+ */
+Window
+wintree_find(struct wintree *wt, int x, int y, int *wx, int *wy)
+{
+	struct winnode *n, *c;
+	int ox, oy, cx, cy;
+
+	wintree_poll(wt, 0);
+
+	n = wt->root;
+	ox = oy = 0;
+	for (;;) {
+		for (c = n->top; c != NULL; c = c->below) {
+			if (c->mapped == 0 || c->placed == 0)
+				continue;
+			cx = ox + c->x;
+			cy = oy + c->y;
+			if (x >= cx && x < cx + c->w + 2 * c->bw &&
+			    y >= cy && y < cy + c->h + 2 * c->bw)
+				break;
+		}
+		if (c == NULL)
+			break;
+		ox += c->x + c->bw;
+		oy += c->y + c->bw;
+		n = c;
+	}
+	*wx = x - ox;
+	*wy = y - oy;
+	return n->id;
+}
+
+/*
+ * Gives the root coordinates of the inside of a window. Returns 0 if
+ * the window is not known.
+ */
+int
+wintree_origin(struct wintree *wt, Window win, int *x, int *y)
+{
+	struct winnode *n;
+
+	if ((n = node_find(wt, win)) == NULL)
+		return 0;
+	*x = *y = 0;
+	for (; n != wt->root; n = n->parent) {
+		*x += n->x + n->bw;
+		*y += n->y + n->bw;
+	}
+	return 1;
+}
+
+static struct winnode *
+node_find(struct wintree *wt, Window id)
+{
+	struct winnode *n;
+
+	for (n = wt->hash[id % WINTREE_BUCKETS]; n != NULL; n = n->hnext)
+		if (n->id == id)
+			return n;
+	return NULL;
+}
+
+/*
+ * Adds a window on top of its siblings, as new windows are created.
+ */
+static struct winnode *
+node_add(struct wintree *wt, struct winnode *parent, Window id)
+{
+	struct winnode *n;
+
+	if ((n = calloc(1, sizeof(*n))) == NULL)
+		err(1, "calloc");
+	n->id = id;
+	n->hnext = wt->hash[id % WINTREE_BUCKETS];
+	wt->hash[id % WINTREE_BUCKETS] = n;
+	if (parent != NULL)
+		node_stack(n, parent, parent->top);
+	wt->windows++;
+	return n;
+}
+
+/*
+ * Forgets a window and everything inside it.
+ */
+static void
+node_remove(struct wintree *wt, struct winnode *n)
+{
+	struct winnode **pp;
+
+	while (n->top != NULL)
+		node_remove(wt, n->top);
+	node_unlink(n);
+	for (pp = &wt->hash[n->id % WINTREE_BUCKETS]; *pp != n;
+	    pp = &(*pp)->hnext)
+		;
+	*pp = n->hnext;
+	if (wt->under == n->id)
+		wt->under = None;
+	if (wt->grab == n->id)
+		wt->grab = None;
+	wt->windows--;
+	free(n);
+}
+
+static void
+node_unlink(struct winnode *n)
+{
+	struct winnode *p = n->parent;
+
+	if (p == NULL)
+		return;
+	if (n->above != NULL)
+		n->above->below = n->below;
+	else
+		p->top = n->below;
+	if (n->below != NULL)
+		n->below->above = n->above;
+	else
+		p->bottom = n->above;
+	n->parent = n->above = n->below = NULL;
+}
+
+/*
+ * Puts an unlinked window among the children of parent, right above
+ * sibling, or at the bottom if sibling is NULL.
+ */
+static void
+node_stack(struct winnode *n, struct winnode *parent, struct winnode *sibling)
+{
+	n->parent = parent;
+	n->below = sibling;
+	if (sibling != NULL) {
+		n->above = sibling->above;
+		sibling->above = n;
+	} else {
+		n->above = parent->bottom;
+		parent->bottom = n;
+	}
+	if (n->above != NULL)
+		n->above->below = n;
+	else
+		parent->top = n;
+}
+
+/*
+ * Starts following the children of a window and asks for the ones it
+ * already has, and for its own geometry and map state if unknown.
+ */
+static void
+wintree_watch(struct wintree *wt, struct winnode *n, int unknown)
+{
+	long mask;
+
+	mask = SubstructureNotifyMask;
+	if (wt->focus != NULL && n->id == wt->focus->win)
+		mask |= FocusChangeMask;
+	XSelectInput(wt->dpy, n->id, mask);
+
+	if (unknown) {
+		wintree_query(wt, WQ_GEOMETRY, n->id,
+		    xcb_get_geometry(wt->conn, n->id).sequence);
+		wintree_query(wt, WQ_ATTRIBUTES, n->id,
+		    xcb_get_window_attributes(wt->conn, n->id).sequence);
+	}
+	wintree_query(wt, WQ_TREE, n->id,
+	    xcb_query_tree(wt->conn, n->id).sequence);
+	xcb_flush(wt->conn);
+}
+
+static void
+wintree_query(struct wintree *wt, int kind, Window win, unsigned int seq)
+{
+	struct winquery *q;
+	size_t i, size;
+
+	if (wt->qlen == wt->qsize) {
+		size = wt->qsize > 0 ? wt->qsize * 2 : 64;
+		if ((q = reallocarray(NULL, size, sizeof(*q))) == NULL)
+			err(1, "reallocarray");
+		for (i = 0; i < wt->qlen; i++)
+			q[i] = wt->q[(wt->qhead + i) % wt->qsize];
+		free(wt->q);
+		wt->q = q;
+		wt->qhead = 0;
+		wt->qsize = size;
+	}
+	q = &wt->q[(wt->qhead + wt->qlen++) % wt->qsize];
+	q->kind = kind;
+	q->win = win;
+	q->seq = seq;
+	wt->queries++;
+}
+
+/*
+ * Handles the replies that have arrived, or with wait set, all of them
+ * including those asked for while handling the others.
+ */
+static void
+wintree_poll(struct wintree *wt, int wait)
+{
+	struct winquery q;
+	xcb_generic_error_t *error;
+	void *reply;
+
+	while (wt->qlen > 0) {
+		q = wt->q[wt->qhead];
+		error = NULL;
+		if (wait)
+			reply = xcb_wait_for_reply(wt->conn, q.seq, &error);
+		else if (xcb_poll_for_reply(wt->conn, q.seq, &reply,
+		    &error) == 0)
+			return;
+		wt->qhead = (wt->qhead + 1) % wt->qsize;
+		wt->qlen--;
+		if (reply != NULL)
+			wintree_reply(wt, &q, reply);
+		free(reply);
+		free(error);
+	}
+}
+
+static void
+wintree_reply(struct wintree *wt, struct winquery *q, void *reply)
+{
+	xcb_query_tree_reply_t *tree;
+	xcb_get_geometry_reply_t *geom;
+	xcb_get_window_attributes_reply_t *attr;
+	struct winnode *n, *c;
+	xcb_window_t *children;
+	int i, len;
+
+	if ((n = node_find(wt, q->win)) == NULL)
+		return;
+
+	switch (q->kind) {
+	case WQ_TREE:
+		tree = reply;
+		children = xcb_query_tree_children(tree);
+		len = xcb_query_tree_children_length(tree);
+		for (i = 0; i < len; i++) {
+			if (node_find(wt, children[i]) != NULL)
+				continue;
+			c = node_add(wt, n, children[i]);
+			wintree_watch(wt, c, 1);
+		}
+		break;
+	case WQ_GEOMETRY:
+		geom = reply;
+		if (n->placed)
+			break;
+		n->x = geom->x;
+		n->y = geom->y;
+		n->w = geom->width;
+		n->h = geom->height;
+		n->bw = geom->border_width;
+		n->placed = 1;
+		break;
+	case WQ_ATTRIBUTES:
+		attr = reply;
+		if (n->map_known)
+			break;
+		n->mapped = (attr->map_state != XCB_MAP_STATE_UNMAPPED);
+		n->map_known = 1;
+		break;
+	}
+}
@@ -0,0 +1,338 @@
+/*
+ * xin - X11 forwarded input receiver
+ * Copyright (c) 2020 Tommi Leino <namhas@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Binary wire protocol.
+ *
+ * A binary stream starts with the 5 byte header "\0XIN" followed by
+ * the protocol version, currently 1. Text streams never start with a
+ * NUL byte, so the header can be detected automatically; with -b the
+ * header is optional.
+ *
+ * Each record is the same control character as in the text protocol
+ * followed by its arguments as zigzag encoded base 128 varints, least
+ * significant group first:
+ *
+ *	'k' keysym		'K' keysym
+ *	'b' state button	'B' state button
+ *	'm' dx dy
+ *	'a' x y screen		'A' x y monitor	(-1 for none)
+ *	'l' length name		(name is not NUL terminated)
+ *	'u' length text		(UTF-8, not NUL terminated)
+ *	'M' count dx dy ...	's' count keysym ...
+ *	'c' button
+ *	'@' usec
+ *	'>' id
+ *
+ * The '@' record is not an event. It advances the stream time by usec
+ * microseconds, and all records after it are timestamped with the
+ * stream time like "@usec" prefixed lines of the text protocol.
+ *
+ * Neither is the '>' record. The records after it are for target id,
+ * like ">id" prefixed lines, until the next '>' record.
+ *
+ * The burst records 'M', 's' and 'c' are expanded like the burst lines
+ * of the text protocol, into count motion events or key presses and
+ * releases, or a button press and release. A long 'u' text is split
+ * into a burst like a long "u text" line.
+ *
+ * A typical motion record takes 3 bytes instead of 7 or more.
+ */
+
+#include "xin.h"
+
+#include <err.h>
+#include <string.h>
+
+#define WIRE_MAGIC	"\0XIN"
+#define WIRE_MAGICLEN	4
+#define WIRE_VERSION	1
+
+static int	get_varint(unsigned char **, unsigned char *, int *);
+static int	get_string(unsigned char **, unsigned char *, int, char **,
+		    size_t *);
+static int	get_burst(unsigned char **, unsigned char *, struct reader *,
+		    struct event *, unsigned char);
+
+/*
+ * Decides between the text and binary protocol by looking at the start
+ * of the stream. Returns 0 if more input is needed.
+ */
+int
+wire_sniff(struct reader *rd)
+{
+	size_t len;
+	unsigned char version;
+
+	len = rd->end - rd->start;
+	if (len == 0 && rd->eof == 0)
+		return 0;
+
+	if (len > 0 && rd->buf[rd->start] == WIRE_MAGIC[0]) {
+		if (len <= WIRE_MAGICLEN && rd->eof == 0)
+			return 0;
+		if (len > WIRE_MAGICLEN &&
+		    memcmp(&rd->buf[rd->start], WIRE_MAGIC,
+		    WIRE_MAGICLEN) == 0) {
+			version = rd->buf[rd->start + WIRE_MAGICLEN];
+			if (version != WIRE_VERSION)
+				errx(1, "unsupported binary protocol "
+				    "version %u", version);
+			rd->start += WIRE_MAGICLEN + 1;
+			rd->mode = READER_BINARY;
+		}
+	}
+
+	if (rd->mode == READER_AUTO)
+		rd->mode = READER_TEXT;
+	rd->sniffed = 1;
+	return 1;
+}
+
+size_t
+wire_parse(struct reader *rd, struct event *ev, size_t nev)
+{
+	unsigned char *p, *q, *end;
+	size_t n, skip;
+	int r, arg;
+
+	end = (unsigned char *) &rd->buf[rd->end];
+	n = 0;
+	while (n < nev && rd->start < rd->end) {
+		if (rd->skip > 0) {
+			skip = rd->end - rd->start;
+			if (skip > rd->skip)
+				skip = rd->skip;
+			rd->start += skip;
+			rd->skip -= skip;
+			continue;
+		}
+
+		p = (unsigned char *) &rd->buf[rd->start];
+		q = p + 1;
+		ev[n].str = NULL;
+		ev[n].v2 = 0;
+		ev[n].v3 = -1;
+		ev[n].more = 0;
+		ev[n].time = rd->timed ? rd->time : -1;
+		ev[n].target = rd->target;
+
+		switch (*p) {
+		case '@':
+		case '>':
+			r = get_varint(&q, end, &arg);
+			break;
+		case 'k':
+		case 'K':
+			r = get_varint(&q, end, &ev[n].v1);
+			break;
+		case 'b':
+		case 'B':
+		case 'm':
+			if ((r = get_varint(&q, end, &ev[n].v1)) == 1)
+				r = get_varint(&q, end, &ev[n].v2);
+			break;
+		case 'a':
+		case 'A':
+			if ((r = get_varint(&q, end, &ev[n].v1)) == 1 &&
+			    (r = get_varint(&q, end, &ev[n].v2)) == 1)
+				r = get_varint(&q, end, &ev[n].v3);
+			break;
+		case 'l':
+			r = get_string(&q, end, MAXSTR, &ev[n].str, &rd->skip);
+			break;
+		case 'u':
+			r = get_string(&q, end, MAXTEXT, &ev[n].str, &rd->skip);
+			break;
+		case 'M':
+		case 's':
+		case 'c':
+			r = get_burst(&q, end, rd, &ev[n], *p);
+			break;
+		default:
+			r = -2;
+			break;
+		}
+
+		if (r == 0) {
+			if (rd->eof) {
+				warnx("parse error; truncated input");
+				rd->truncated++;
+				rd->start = rd->end;
+			}
+			break;
+		}
+
+		rd->start = (char *) q - rd->buf;
+		if (r == -2) {
+			/*
+			 * Framing is lost; resynchronize by trying the
+			 * next byte, but complain only once.
+			 */
+			rd->start = (char *) p + 1 - rd->buf;
+			if (rd->skip_truncated == 0)
+				warnx("parse error; unknown control");
+			rd->skip_truncated = 1;
+			rd->errors++;
+			continue;
+		} else if (r == -1) {
+			rd->errors++;
+			continue;
+		}
+
+		rd->skip_truncated = 0;
+		if (*p == '@') {
+			if (arg < 0) {
+				warnx("parse error; invalid timestamp");
+				rd->errors++;
+				continue;
+			}
+			rd->time += arg;
+			rd->timed = 1;
+			continue;
+		} else if (*p == '>') {
+			if (arg < 0) {
+				warnx("parse error; invalid target");
+				rd->errors++;
+				continue;
+			}
+			rd->target = arg;
+			continue;
+		} else if (*p == 'M' || *p == 's' || *p == 'c') {
+			n += reader_burst_take(rd, &ev[n], nev - n);
+			continue;
+		} else if (*p == 'u' && strlen(ev[n].str) >= MAXSTR) {
+			reader_burst_text(rd, &ev[n], ev[n].str,
+			    strlen(ev[n].str));
+			return n + reader_burst_take(rd, &ev[n], nev - n);
+		}
+		ev[n++].type = *p;
+	}
+	return n;
+}
+
+/*
+ * Returns 1 on success, 0 if the varint continues past the end of
+ * buffer and -1 if it is longer than any 32-bit value can be.
+ */
+static int
+get_varint(unsigned char **pp, unsigned char *end, int *v)
+{
+	unsigned char *p;
+	unsigned long u;
+	int shift;
+
+	p = *pp;
+	u = 0;
+	for (shift = 0; shift < 35; shift += 7) {
+		if (p == end)
+			return 0;
+		u |= (unsigned long) (*p & 0x7f) << shift;
+		if ((*p++ & 0x80) == 0) {
+			u &= 0xffffffffUL;
+			*v = (int) (u >> 1) ^ -(int) (u & 1);
+			*pp = p;
+			return 1;
+		}
+	}
+	warnx("parse error; invalid varint");
+	*pp = p;
+	return -1;
+}
+
+/*
+ * The string, shorter than max bytes, is moved one byte down over the
+ * last byte of its length prefix to make room for the terminating NUL,
+ * so that it can be referenced in place like in the text protocol.
+ */
+static int
+get_string(unsigned char **pp, unsigned char *end, int max, char **str,
+    size_t *skip)
+{
+	unsigned char *q;
+	int len, r;
+
+	q = *pp;
+	if ((r = get_varint(&q, end, &len)) != 1) {
+		*pp = q;
+		return r;
+	}
+	if (len <= 0 || len >= max) {
+		warnx("parse error; truncated input");
+		*pp = q;
+		if (len > 0)
+			*skip = len;
+		return -1;
+	}
+	if (end - q < len)
+		return 0;
+
+	memmove(q - 1, q, len);
+	q[len - 1] = '\0';
+	*str = (char *) q - 1;
+	*pp = q + len;
+	return 1;
+}
+
+/*
+ * Expands a burst record into the reader's burst buffer, but only once
+ * all of it is there.
+ */
+static int
+get_burst(unsigned char **pp, unsigned char *end, struct reader *rd,
+    struct event *ev, unsigned char type)
+{
+	unsigned char *q;
+	int count, i, v1, v2, r;
+
+	q = *pp;
+	count = 1;
+	if (type != 'c' && (r = get_varint(&q, end, &count)) != 1) {
+		*pp = q;
+		return r;
+	}
+	if (count <= 0 || count > BURST_MAX) {
+		warnx("parse error; invalid burst length");
+		*pp = q;
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		if ((r = get_varint(&q, end, &v1)) != 1 ||
+		    (type == 'M' && (r = get_varint(&q, end, &v2)) != 1)) {
+			rd->nburst = 0;
+			*pp = q;
+			return r;
+		}
+		switch (type) {
+		case 'M':
+			reader_burst_add(rd, ev, 'm', v1, v2);
+			break;
+		case 's':
+			reader_burst_add(rd, ev, 'k', v1, 0);
+			reader_burst_add(rd, ev, 'K', v1, 0);
+			break;
+		case 'c':
+			reader_burst_add(rd, ev, 'b', 0, v1);
+			reader_burst_add(rd, ev, 'B', 0, v1);
+			break;
+		}
+	}
+	rd->bursts++;
+	*pp = q;
+	return 1;
+}
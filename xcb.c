@@ -0,0 +1,147 @@
+/*
+ * xin - X11 forwarded input receiver
+ * Copyright (c) 2020 Tommi Leino <namhas@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * XTEST injection through xcb.
+ *
+ * The requests go out on the same connection as Xlib's, so ordering
+ * with the Xlib requests made elsewhere is kept. The initial pointer
+ * position is requested already at startup, so that a motion event
+ * right after it does not wait for a round trip. By the time the first
+ * motion comes, the pointer may have moved, though: an answer that has
+ * already arrived is only used if XI2 raw motion shows that no other
+ * device has moved the pointer since, and otherwise it is asked again,
+ * like the Xlib method does.
+ */
+
+#include "xin.h"
+
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
+#include <xcb/xtest.h>
+#include <xcb/xcbext.h>
+#include <err.h>
+#include <stdlib.h>
+
+struct xcb_state {
+	xcb_connection_t		*conn;
+	xcb_query_pointer_cookie_t	 pointer;
+};
+
+static void	xc_init(struct injector *);
+static void	xc_key(struct injector *, KeyCode, unsigned int, Bool);
+static void	xc_button(struct injector *, unsigned int, Bool);
+static void	xc_motion(struct injector *, int, int, int);
+static void	xc_pointer(struct injector *, int *, int *);
+static void	xc_flush(struct injector *);
+
+const struct backend xcb_backend = {
+	"xcb",
+	xc_init,
+	xc_key,
+	xc_button,
+	xc_motion,
+	xc_pointer,
+	xc_flush
+};
+
+static void
+xc_init(struct injector *inj)
+{
+	struct xcb_state *xs;
+	const xcb_query_extension_reply_t *ext;
+
+	if ((xs = calloc(1, sizeof(*xs))) == NULL)
+		err(1, "calloc");
+	xs->conn = XGetXCBConnection(inj->dpy);
+
+	ext = xcb_get_extension_data(xs->conn, &xcb_test_id);
+	if (ext == NULL || ext->present == 0)
+		errx(1, "XTEST not available; try -s");
+
+	xs->pointer = xcb_query_pointer(xs->conn, RootWindow(inj->dpy, 0));
+	xcb_flush(xs->conn);
+	inj->priv = xs;
+}
+
+static void
+xc_key(struct injector *inj, KeyCode keycode, unsigned int mods, Bool is_press)
+{
+	struct xcb_state *xs = inj->priv;
+
+	xcb_test_fake_input(xs->conn,
+	    is_press ? XCB_KEY_PRESS : XCB_KEY_RELEASE, keycode,
+	    XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
+}
+
+static void
+xc_button(struct injector *inj, unsigned int button, Bool is_press)
+{
+	struct xcb_state *xs = inj->priv;
+
+	xcb_test_fake_input(xs->conn,
+	    is_press ? XCB_BUTTON_PRESS : XCB_BUTTON_RELEASE, button,
+	    XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
+}
+
+static void
+xc_motion(struct injector *inj, int screen, int x, int y)
+{
+	struct xcb_state *xs = inj->priv;
+
+	xcb_test_fake_input(xs->conn, XCB_MOTION_NOTIFY, 0,
+	    XCB_CURRENT_TIME, RootWindow(inj->dpy, screen), x, y, 0);
+}
+
+static void
+xc_pointer(struct injector *inj, int *x, int *y)
+{
+	struct xcb_state *xs = inj->priv;
+	xcb_query_pointer_reply_t *reply;
+	xcb_generic_error_t *error;
+
+	*x = *y = 0;
+	reply = NULL;
+	if (xcb_poll_for_reply(xs->conn, xs->pointer.sequence,
+	    (void **) &reply, &error) == 1) {
+		free(error);
+		if (reply != NULL &&
+		    (inj->ptr.dpy == NULL || inj->ptr.foreign > 0)) {
+			free(reply);
+			reply = NULL;
+		}
+		if (reply == NULL)
+			xs->pointer = xcb_query_pointer(xs->conn,
+			    RootWindow(inj->dpy, 0));
+	}
+	if (reply == NULL && (reply = xcb_query_pointer_reply(xs->conn,
+	    xs->pointer, NULL)) == NULL) {
+		warnx("couldn't query initial pointer position");
+		return;
+	}
+	*x = reply->root_x;
+	*y = reply->root_y;
+	free(reply);
+}
+
+static void
+xc_flush(struct injector *inj)
+{
+	struct xcb_state *xs = inj->priv;
+
+	xcb_flush(xs->conn);
+}
@@ -15,6 +15,9 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include "xin.h"
+
+#include <sys/resource.h>
 #include <X11/extensions/XTest.h>
 #include <X11/Xlib.h>
 #include <X11/XKBlib.h>
@@ -24,98 +27,263 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
-#include <ctype.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
 
-static void xmotion(Display *, int, int);
-static void xkey(Display *, char, int, int);
-static void xkblayout(Display *, char *);
-static void xkey_sendevent(Display *, char, int, int);
-static void xbutton(Display *, char, int, int);
-static void update_mapping(Display *, XEvent *);
+static void xmotion(struct injector *, int, int);
+static void xabsolute(struct injector *, char, int, int, int);
+static void xmotion_queue(struct injector *);
+static void xclamp(struct injector *);
+static int normalize(int, int);
+static void xkey(struct injector *, char, int);
+static void xtext(struct injector *, const char *, int);
+static void xtext_type(struct injector *);
+static int text_keysyms(const char *, KeySym *, int);
+static void xremap(struct injector *);
+static void xbutton(struct injector *, char, int, int);
+static void xrelease(struct injector *);
+static void update_mapping(struct injector *, XEvent *);
+static void xevents(struct injector *);
+static int xerror(Display *, XErrorEvent *);
+static int dispatch(struct injector *, struct event *);
+static long getnum(const char *, long, long, const char *);
+static void gettarget(char *, struct target *);
+static double getspeed(const char *);
+static const struct backend *getbackend(const char *);
+static void on_sigusr1(int);
+static void run_stats(const struct timespec *, unsigned long long);
+static int drain(struct injector *, struct ring *);
 
 extern int optind;
+extern char *optarg;
+
+static int (*xerror_default)(Display *, XErrorEvent *);
+
+static volatile sig_atomic_t dump_latency;
 
-enum inject_method {
-	INJECT_METHOD_XTEST,
-	INJECT_METHOD_SENDEVENT
+static const struct backend *backends[] = {
+	&xtest_backend,
+	&sendevent_backend,
+	&xcb_backend,
+	&uinput_backend
 };
 
 void
-xkey(Display *dpy, char type, int state, int keycode)
+xkey(struct injector *inj, char type, int state)
 {
+	struct timespec t0;
+	KeyCode keycode;
+	unsigned int mods;
 	Bool is_press;
 
 	is_press = (type == 'k') ? True : False;
-	if (keycode == 0) {
-		keycode = XKeysymToKeycode(dpy, state);
+	latency_mark(inj->latency, &t0);
+	keycode = keymap_lookup(&inj->keymap, state, &mods);
+	if (keycode == 0 && is_press) {
+		/* No key has it; put it on a scratch key. */
+		keymap_pin(&inj->keymap);
+		if ((keycode = keymap_scratch(&inj->keymap, state,
+		    inj->keys)) != 0)
+			xremap(inj);
 	}
+	latency_record(inj->latency, STAGE_LOOKUP, type, &t0);
 	if (keycode == 0) {
 		warnx("couldn't find keycode for a keysym");
 		return;
 	}
-	XTestFakeKeyEvent(dpy, keycode, is_press, 0);
-	XFlush(dpy);
+	if (is_press)
+		inj->keys[keycode / 8] |= 1 << (keycode % 8);
+	else
+		inj->keys[keycode / 8] &= ~(1 << (keycode % 8));
+	latency_mark(inj->latency, &t0);
+	inj->backend->key(inj, keycode, mods, is_press);
+	latency_record(inj->latency, STAGE_REQUEST, type, &t0);
+	probe_sent(inj->probe, is_press ? KeyPress : KeyRelease, keycode);
+	flush_request(&inj->flush);
 }
 
-void
-xkey_sendevent(Display *dpy, char type, int state, int keycode)
+/*
+ * Types UTF-8 text, or a piece of it if more follow. The keysyms that
+ * no key produces are put on scratch keys before typing, and the text
+ * is typed only once all of its pieces are in or the scratch keys run
+ * out, so that it costs one remap per as many keysyms as there are
+ * scratch keys, however it was split.
+ */
+static void
+xtext(struct injector *inj, const char *text, int more)
 {
-	Window focus;
-	int revert_to;
-	static int modifiers;
-	Bool is_press;
-	XEvent e = { 0 };
+	KeySym keysym[MAXSTR];
+	unsigned int mods;
+	int i, n;
 
-	if (XGetInputFocus(dpy, &focus, &revert_to) == False) {
-		warnx("no input focus; sending events to root window");
-		focus = RootWindow(dpy, 0);
+	n = text_keysyms(text, keysym, MAXSTR);
+	if (inj->ntext == 0)
+		keymap_pin(&inj->keymap);
+	for (i = 0; i < n; i++) {
+		if (inj->ntext == MAXTEXT)
+			xtext_type(inj);
+		if (keymap_lookup(&inj->keymap, keysym[i], &mods) == 0 &&
+		    keymap_scratch(&inj->keymap, keysym[i], inj->keys) == 0) {
+			/* Out of keys; if none is free, xkey() complains. */
+			xtext_type(inj);
+			keymap_pin(&inj->keymap);
+			keymap_scratch(&inj->keymap, keysym[i], inj->keys);
+		}
+		inj->text[inj->ntext++] = keysym[i];
 	}
+	if (more == 0)
+		xtext_type(inj);
+}
 
-	is_press = (type == 'k') ? True : False;
-	e.type = (is_press == True) ? KeyPress : KeyRelease;
-	e.xkey.keycode = XKeysymToKeycode(dpy, state);
-	e.xkey.window = focus;
-	e.xkey.subwindow = focus;
-	if (is_press)
-		modifiers |= XkbKeysymToModifiers(dpy, state);
-	else
-		modifiers &= ~XkbKeysymToModifiers(dpy, state);
-	e.xkey.state = modifiers;
-	e.xkey.type = (is_press == True) ? KeyPress : KeyRelease;
-	e.xkey.time = CurrentTime;
-	XSendEvent(dpy, focus, False,
-	    (is_press == True) ? KeyPressMask : KeyReleaseMask, &e);
-	XFlush(dpy);
+/*
+ * Remaps the scratch keys and types the text collected so far.
+ */
+static void
+xtext_type(struct injector *inj)
+{
+	int i;
+
+	if (inj->ntext == 0)
+		return;
+	xremap(inj);
+	for (i = 0; i < inj->ntext; i++) {
+		xkey(inj, 'k', inj->text[i]);
+		xkey(inj, 'K', inj->text[i]);
+	}
+	inj->ntext = 0;
+}
+
+/*
+ * Decodes UTF-8 text into at most max keysyms, the Unicode keysym of
+ * each character except for Latin-1, which has keysyms of its own, and
+ * tabs and newlines. Other control characters are skipped. Returns the
+ * number of keysyms.
+ */
+static int
+text_keysyms(const char *text, KeySym *keysym, int max)
+{
+	const unsigned char *p;
+	unsigned long c;
+	int n, i, len;
+
+	p = (const unsigned char *) text;
+	for (n = 0; *p != '\0' && n < max; p += len) {
+		if (*p < 0x80) {
+			c = *p;
+			len = 1;
+		} else if ((*p & 0xe0) == 0xc0) {
+			c = *p & 0x1f;
+			len = 2;
+		} else if ((*p & 0xf0) == 0xe0) {
+			c = *p & 0x0f;
+			len = 3;
+		} else if ((*p & 0xf8) == 0xf0) {
+			c = *p & 0x07;
+			len = 4;
+		} else
+			len = 0;
+		for (i = 1; i < len && (p[i] & 0xc0) == 0x80; i++)
+			c = c << 6 | (p[i] & 0x3f);
+		if (len == 0 || i < len || c > 0x10ffff) {
+			warnx("invalid UTF-8 text");
+			break;
+		}
+
+		if (c == '\t')
+			keysym[n++] = XK_Tab;
+		else if (c == '\n' || c == '\r')
+			keysym[n++] = XK_Return;
+		else if (c < 0x20 || (c >= 0x7f && c < 0xa0))
+			continue;
+		else if (c < 0x100)
+			keysym[n++] = c;
+		else
+			keysym[n++] = 0x1000000 | c;
+	}
+	return n;
+}
+
+/*
+ * Sends the changes of scratch keys. Keys written to uinput do not go
+ * through our requests, so with it the remap is waited for.
+ */
+static void
+xremap(struct injector *inj)
+{
+	if (keymap_remap(&inj->keymap) == 0)
+		return;
+	flush_request(&inj->flush);
+	if (inj->backend == &uinput_backend)
+		XSync(inj->dpy, False);
 }
 
 void
-xbutton(Display *dpy, char type, int state, int button)
+xbutton(struct injector *inj, char type, int state, int button)
 {
+	struct timespec t0;
 	Bool is_press;
 
 	is_press = (type == 'b') ? True : False;
-	XTestFakeButtonEvent(dpy, button, is_press, 0);
-	XFlush(dpy);
+	if (button > 0 && button < 32) {
+		if (is_press)
+			inj->buttons |= 1U << button;
+		else
+			inj->buttons &= ~(1U << button);
+	}
+	latency_mark(inj->latency, &t0);
+	inj->backend->button(inj, button, is_press);
+	latency_record(inj->latency, STAGE_REQUEST, type, &t0);
+	probe_sent(inj->probe, is_press ? ButtonPress : ButtonRelease, button);
+	flush_request(&inj->flush);
 }
 
+/*
+ * Releases every key and button we hold down. The releases we knew of
+ * may have been dropped when a display fell too far behind.
+ */
 void
-xmotion(Display *dpy, int x, int y)
+xrelease(struct injector *inj)
 {
-	static XButtonEvent xb;
-	int maxw, maxh;
+	int i;
 
-	/* Query initial pointer */
-	if (xb.root == None) {
-		XQueryPointer(dpy, RootWindow(dpy, 0),
-		    &xb.root, &xb.window, &xb.x_root, &xb.y_root,
-		    &xb.x, &xb.y, &xb.state);
-	}
+	for (i = 0; i < 256; i++)
+		if (inj->keys[i / 8] & (1 << (i % 8))) {
+			inj->keys[i / 8] &= ~(1 << (i % 8));
+			inj->backend->key(inj, i, 0, False);
+			flush_request(&inj->flush);
+		}
+	for (i = 1; i < 32; i++)
+		if (inj->buttons & (1U << i)) {
+			inj->buttons &= ~(1U << i);
+			inj->backend->button(inj, i, False);
+			flush_request(&inj->flush);
+		}
+}
+
+/*
+ * Asks where the pointer is before its position is first used.
+ */
+void
+xpointer(struct injector *inj)
+{
+	if (inj->have_pointer)
+		return;
+	inj->backend->pointer(inj, &inj->x, &inj->y);
+	inj->have_pointer = 1;
+	inj->ptr.sx = inj->x;
+	inj->ptr.sy = inj->y;
+}
 
-	/* Geometry */
-	maxw = DisplayWidth(dpy, DefaultScreen(dpy));
-	maxh = DisplayHeight(dpy, DefaultScreen(dpy));
+void
+xmotion(struct injector *inj, int x, int y)
+{
+	xpointer(inj);
+
+	/* Follow the pointer if someone else has moved it. */
+	pointer_sync(inj);
 
 	/*
 	 * We use don't use the RelativeMotion variant of the XTest
@@ -123,64 +291,162 @@ xmotion(Display *dpy, int x, int y)
 	 * breaking up things and didn't follow its documentation.
 	 * Otherwise, it would be simpler to use the relative version.
 	 */
-	xb.x_root -= x;
-	xb.y_root -= y;
-	if (xb.x_root < 0)
-		xb.x_root = 0;
-	if (xb.y_root < 0)
-		xb.y_root = 0;
-	if (xb.x_root >= maxw)
-		xb.x_root = maxw;
-	if (xb.y_root >= maxh)
-		xb.y_root = maxh;
-	XTestFakeMotionEvent(dpy, 0, xb.x_root, xb.y_root, 0);
-	XFlush(dpy);
+	inj->x -= x;
+	inj->y -= y;
+	xclamp(inj);
+	xmotion_queue(inj);
 }
 
-int
-main(int argc, char **argv)
+/*
+ * Moves the pointer to an absolute position: with 'a' in pixels on the
+ * given screen, and with 'A' in 0..NORM_MAX over the given monitor of
+ * screen 0. Without a screen or monitor, the current screen is used.
+ */
+static void
+xabsolute(struct injector *inj, char type, int x, int y, int which)
 {
-	Display *dpy;
-	char buf[64], c, *denv;
-	int v1, v2, n, skip_truncated;
-	int xtst_event, xtst_error, xtst_majv, xtst_minv;
-	int xkbmaj, xkbmin, xkb_op, xkb_event, xkb_error;
-	int method, want_xtst;
-	char *layout;
+	struct monitor *m, whole;
+	int screen;
 
-#ifdef __OpenBSD__
-	if (pledge("stdio rpath dns unix inet proc exec", NULL) != 0)
-		err(1, "pledge");
-#endif
+	screen = inj->screen;
+	if (type == 'a' && which >= 0) {
+		if (which >= ScreenCount(inj->dpy)) {
+			warnx("no screen %d", which);
+			return;
+		}
+		screen = which;
+	} else if (type == 'A') {
+		if (which >= 0) {
+			if ((m = geometry_get(&inj->geom, which)) == NULL) {
+				warnx("no monitor %d", which);
+				return;
+			}
+			screen = 0;
+		} else {
+			whole.x = 0;
+			whole.y = 0;
+			whole.w = DisplayWidth(inj->dpy, screen);
+			whole.h = DisplayHeight(inj->dpy, screen);
+			m = &whole;
+		}
+		x = m->x + normalize(x, m->w);
+		y = m->y + normalize(y, m->h);
+	}
 
-	if ((denv = getenv("DISPLAY")) == NULL && errno != 0)
-		err(1, "getenv");
-	if ((dpy = XOpenDisplay(denv)) == NULL) {
-		if (denv == NULL)
-			errx(1, "X11 connection failed; "
-			    "DISPLAY environment variable not set?");
-		else
-			errx(1, "failed X11 connection to '%s'", denv);
+	/* No need to ask where the pointer is; relative motion continues. */
+	inj->have_pointer = 1;
+	pointer_warped(&inj->ptr);
+	inj->screen = screen;
+	inj->x = x;
+	inj->y = y;
+	xclamp(inj);
+	xmotion_queue(inj);
+}
+
+static void
+xmotion_queue(struct injector *inj)
+{
+	/*
+	 * When coalescing, only the final position of a run of buffered
+	 * motion events is injected. The run ends at the first event of
+	 * another type or when the buffered input runs out.
+	 */
+	inj->motions++;
+	if (inj->motion_pending)
+		inj->merged++;
+	inj->motion_pending = 1;
+	if (inj->coalesce == 0 && inj->ahead == 0)
+		xmotion_commit(inj);
+}
+
+/*
+ * Keeps the pointer on the monitors of screen 0, or inside any other
+ * screen, which the monitors are not known for.
+ */
+static void
+xclamp(struct injector *inj)
+{
+	int w, h;
+
+	if (inj->screen == 0) {
+		geometry_clamp(&inj->geom, &inj->x, &inj->y);
+		return;
+	}
+	w = DisplayWidth(inj->dpy, inj->screen);
+	h = DisplayHeight(inj->dpy, inj->screen);
+	if (inj->x < 0)
+		inj->x = 0;
+	else if (inj->x >= w)
+		inj->x = w - 1;
+	if (inj->y < 0)
+		inj->y = 0;
+	else if (inj->y >= h)
+		inj->y = h - 1;
+}
+
+/*
+ * Scales v in 0..NORM_MAX to a pixel in 0..size-1.
+ */
+static int
+normalize(int v, int size)
+{
+	if (v < 0)
+		v = 0;
+	else if (v > NORM_MAX)
+		v = NORM_MAX;
+	return ((long) v * (size - 1) + NORM_MAX / 2) / NORM_MAX;
+}
+
+void
+xmotion_commit(struct injector *inj)
+{
+	struct timespec t0, t1, t2;
+
+	if (inj->motion_pending == 0)
+		return;
+	inj->motion_pending = 0;
+	if (inj->priority)
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+	latency_mark(inj->latency, &t0);
+	inj->backend->motion(inj, inj->screen, inj->x, inj->y);
+	inj->ptr.sx = inj->x;
+	inj->ptr.sy = inj->y;
+	latency_record(inj->latency, STAGE_REQUEST, 'm', &t0);
+	probe_sent(inj->probe, MotionNotify, 0);
+	flush_request(&inj->flush);
+
+	/* What a motion request costs, for the priority lane savings. */
+	if (inj->priority) {
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+		inj->motion_ns += (t2.tv_sec - t1.tv_sec) * 1000000000LL +
+		    t2.tv_nsec - t1.tv_nsec;
+		inj->motion_requests++;
 	}
+}
+
+int
+main(int argc, char **argv)
+{
+	static struct reader rd;
+	static struct injector inj;
+	static struct metrics metrics;
+	static struct ring ringbuf;
+	static struct fanout fanout;
+	struct options opt;
+	struct ring *ring;
+	struct sigaction sa;
+	struct timespec start;
+	struct target *targets;
+	char c;
+	int ntargets, ndisplays, route, verbose, histograms, probe, threaded;
+	long lag;
+	char *sockpath;
+	enum reader_mode mode;
 
 #ifdef __OpenBSD__
-	if (pledge("stdio rpath proc exec", NULL) != 0)
+	if (pledge("stdio rpath cpath dns unix inet proc exec", NULL) != 0)
 		err(1, "pledge");
 #endif
-	/*
-	 * We use XKB extension because we wish to extract the current
-	 * set of modifiers from a KeySym for SendEvent event injection
-	 * type. If the SendEvent type is not needed, use of XKB extension
-	 * could be removed.
-	 */
-	xkbmaj = XkbMajorVersion;
-	xkbmin = XkbMinorVersion;
-	if (XkbLibraryVersion(&xkbmaj, &xkbmin) == False)
-		errx(1, "trouble with XKB extension; needed %d.%d got %d.%d",
-		    XkbMajorVersion, XkbMinorVersion, xkbmaj, xkbmin);
-	if (XkbQueryExtension(dpy, &xkb_op, &xkb_event, &xkb_error,
-	    &xkbmaj, &xkbmin) == False)
-		errx(1, "trouble with XKB extension");
 
 	/*
 	 * By default we really wish to use XTEST because XTEST sends
@@ -189,18 +455,119 @@ main(int argc, char **argv)
 	 * by applications. However, sometimes using the SendEvent might
 	 * be handy, for example if XTEST extension is disabled.
 	 *
-	 * TODO: The SendEvent implementation is not fully complete yet.
+	 * SendEvent needs to know the window under the pointer, which
+	 * it keeps track of with a copy of the window tree.
+	 *
+	 * The xcb method injects the same XTEST requests as the default
+	 * one, but without going through Xlib and without waiting for
+	 * replies in the event path.
+	 *
+	 * On Linux, the uinput method bypasses the X server's request
+	 * queue altogether and feeds the events to the kernel through
+	 * a virtual input device instead.
 	 */
-	want_xtst = 1;
+	opt.backend = &xtest_backend;
+	opt.max_pending = 64;
+	opt.latency = 1000;
+	opt.coalesce = 1;
+	opt.priority = 0;
+	opt.focus_resync = 0;
+	opt.layout_wait = 1000;
+	opt.preload = NULL;
+	opt.speed = 1;
+	verbose = 0;
+	mode = READER_AUTO;
+	histograms = 0;
+	probe = 0;
+	threaded = 0;
+	sockpath = NULL;
+	targets = NULL;
+	ntargets = 0;
+	ndisplays = 0;
+	route = 0;
+	lag = 1000;
 	if (argc >= 2) {
-		while ((c = getopt(argc, argv, "s")) != -1) {
+		while ((c = getopt(argc, argv,
+		    "bd:f:g:HL:l:Mm:n:Ppr:S:st:Tvw:")) != -1) {
 			switch (c) {
+			case 'b':
+				mode = READER_BINARY;
+				break;
+			case 'd':
+			case 't':
+				if ((targets = reallocarray(targets,
+				    ntargets + 1, sizeof(*targets))) == NULL)
+					err(1, "reallocarray");
+				if (c == 't') {
+					gettarget(optarg, &targets[ntargets]);
+					route = 1;
+				} else {
+					targets[ntargets].id = -1;
+					targets[ntargets].display = optarg;
+					targets[ntargets].device = NULL;
+					ndisplays++;
+				}
+				ntargets++;
+				break;
+			case 'f':
+				opt.focus_resync = getnum(optarg, 0, 3600000,
+				    "focus resync interval");
+				break;
+			case 'g':
+				lag = getnum(optarg, 0, 3600000, "lag bound");
+				break;
+			case 'H':
+				histograms = 1;
+				break;
+			case 'L':
+				opt.preload = optarg;
+				break;
+			case 'l':
+				opt.layout_wait = getnum(optarg, 1, 3600000,
+				    "layout switch timeout");
+				break;
+			case 'M':
+				opt.coalesce = 0;
+				break;
+			case 'm':
+				opt.backend = getbackend(optarg);
+				break;
+			case 'n':
+				opt.max_pending = getnum(optarg, 1, 65536,
+				    "pending requests");
+				break;
+			case 'P':
+				probe = 1;
+				break;
+			case 'p':
+				opt.priority = 1;
+				break;
+			case 'r':
+				opt.speed = getspeed(optarg);
+				break;
+			case 'S':
+				sockpath = optarg;
+				break;
 			case 's':
-				want_xtst = 0;
+				opt.backend = &sendevent_backend;
+				break;
+			case 'T':
+				threaded = 1;
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			case 'w':
+				opt.latency = getnum(optarg, 0, 10000000,
+				    "flush latency");
 				break;
 			default:
-				fprintf(stderr, "Usage: %s [-s]\n",
-				    argv[0]);
+				fprintf(stderr, "Usage: %s [-bHMPpsTv] "
+				    "[-d display ...] [-f msec] [-g msec]\n"
+				    "\t[-L layout,...] [-l msec] [-m method] "
+				    "[-n requests] [-r speed]\n"
+				    "\t[-S socket] [-t id=display[,device] ...] "
+				    "[-w usec]\n", argv[0]);
 				return 1;
 			}
 		}
@@ -208,118 +575,600 @@ main(int argc, char **argv)
 		argv += optind;
 	}
 
-	if (want_xtst == 1) {
-		if (XTestQueryExtension(dpy, &xtst_event, &xtst_error,
-		    &xtst_majv, &xtst_minv) == False)
-			errx(1, "XTEST not available; try %s -s",
-			    argv[0]);
-		method = INJECT_METHOD_XTEST;
-	} else
-		method = INJECT_METHOD_SENDEVENT;
-
-	skip_truncated = 0;
-	while (fgets(buf, sizeof(buf), stdin) != NULL) {
-		n = strcspn(buf, "\r\n");
-		if (buf[n] == '\0') {
-			if (skip_truncated == 0)
-				warnx("parse error; truncated input");
-			skip_truncated = 1;
-			continue;
-		} else if (skip_truncated) {
-			skip_truncated = 0;
-			continue;
-		}
-		buf[n] = '\0';
-		if (buf[0] == 'l' && n > 2) {
-			layout = &buf[2];
-			xkblayout(dpy, layout);
-		} else if (sscanf(buf, "%c %d", &c, &v1) == 2 &&
-		    (c == 'k' || c == 'K')) {
-				if (method == INJECT_METHOD_SENDEVENT)
-					xkey_sendevent(dpy, c, v1, 0);
-				else
-					xkey(dpy, c, v1, 0);
-		} else if (sscanf(buf, "%c %d %d", &c, &v1, &v2) != 3) {
-			warnx("parse error; invalid or incomplete format");
-		} else {
-			switch(c) {
-			case 'm':
-				xmotion(dpy, v1, v2);
-				break;
-			case 'b':
-			case 'B':
-				xbutton(dpy, c, v1, v2);
-				break;
-			case 'k':
-			case 'K':
-				xkey(dpy, c, v1, v2);
-				break;
-			default:
-				warnx("parse error; unknown control");
-				break;
-			}
+	/*
+	 * With several displays or with targets, every display or target
+	 * has its own connection and injector on a thread of its own.
+	 */
+	if (route || ntargets > 1) {
+		if (histograms || probe || threaded || sockpath != NULL)
+			errx(1, "-H, -P, -S and -T work with one display only");
+		if (route && ndisplays > 0)
+			errx(1, "-d and -t are mutually exclusive");
+		if (XInitThreads() == 0)
+			errx(1, "Xlib has no thread support");
+	}
+
+	xerror_default = XSetErrorHandler(xerror);
+	reader_init(&rd, STDIN_FILENO, mode);
+
+	if (route || ntargets > 1) {
+		fanout_init(&fanout, targets, ntargets, route, lag, &opt);
+#ifdef __OpenBSD__
+		if (pledge("stdio rpath proc exec", NULL) != 0)
+			err(1, "pledge");
+#endif
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		fanout_run(&fanout, &rd);
+		if (verbose) {
+			run_stats(&start, rd.events);
+			reader_stats(&rd);
+			fanout_stats(&fanout);
 		}
+		fanout_replay_stats(&fanout);
+		return EXIT_SUCCESS;
 	}
-	if (ferror(stdin))
-		err(1, "reading stdin");
-	else if (!feof(stdin) && errno != 0)
-		err(1, "fgets");
+
+	injector_open(&inj, ntargets == 1 ? targets[0].display : NULL, &opt);
+	if (probe) {
+		if (opt.backend == &sendevent_backend)
+			errx(1, "-P needs an XTEST based injection method");
+		inj.probe = probe_new(inj.dpy);
+	}
+	if (histograms) {
+		inj.latency = latency_new();
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = on_sigusr1;
+		sigemptyset(&sa.sa_mask);
+		if (sigaction(SIGUSR1, &sa, NULL) == -1)
+			err(1, "sigaction");
+	}
+	metrics_init(&metrics, sockpath, &rd, &inj);
+	ring = NULL;
+	if (threaded) {
+		ring = &ringbuf;
+		ring_init(ring);
+		metrics.ring = ring;
+	}
+
+#ifdef __OpenBSD__
+	if (pledge(sockpath != NULL ? "stdio rpath unix proc exec" :
+	    "stdio rpath proc exec", NULL) != 0)
+		err(1, "pledge");
+#endif
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (ring != NULL)
+		ring_start(ring, &rd, inj.latency);
+	injector_run(&inj, &rd, ring, &metrics);
+	if (ring != NULL)
+		ring_join(ring);
+	injector_finish(&inj);
+	if (inj.latency != NULL)
+		latency_dump(inj.latency);
+	if (inj.probe != NULL) {
+		probe_finish(inj.probe);
+		probe_stats(inj.probe);
+	}
+
+	if (verbose) {
+		run_stats(&start, rd.events);
+		reader_stats(&rd);
+		if (ring != NULL)
+			ring_stats(ring);
+		injector_stats(&inj);
+	}
+	replay_stats(&inj.replay, NULL);
 
 	return EXIT_SUCCESS;
 }
 
-static void
-xkblayout(Display *dpy, char *layout)
+/*
+ * Estimates the time the priority lane has saved from the motion
+ * requests it has saved and the average cost of one, in seconds.
+ */
+double
+injector_saved(struct injector *inj)
 {
-	char *p, s[128];
-	XEvent e;
+	if (inj->motion_requests == 0)
+		return 0;
+	return inj->saved * ((double) inj->motion_ns / inj->motion_requests) /
+	    1e9;
+}
 
-	for (p = layout; *p != '\0'; p++)
-		if (isalpha(*p) == 0) {
-			warnx("layout name cannot contain special "
-			    "characters");
-			return;
-		}
+/*
+ * Connects to a display and sets up everything needed to inject to it.
+ */
+void
+injector_open(struct injector *inj, const char *name,
+    const struct options *opt)
+{
+	Display *dpy;
+	char *preload;
+	int xkbmaj, xkbmin, xkb_op, xkb_event, xkb_error;
 
-	if (snprintf(s, sizeof(s), "setxkbmap %s", layout) >= sizeof(s)) {
-		warnx("layout name too long");
-		return;
+	if ((dpy = XOpenDisplay(name)) == NULL) {
+		if (name == NULL && getenv("DISPLAY") == NULL)
+			errx(1, "X11 connection failed; "
+			    "DISPLAY environment variable not set?");
+		else
+			errx(1, "failed X11 connection to '%s'",
+			    XDisplayName(name));
 	}
 
-	XGrabKey(dpy, XKeysymToKeycode(dpy, XStringToKeysym("Super_L")), 0,
-	    RootWindow(dpy, 0), 0, 0, 1);
-	XSync(dpy, False);
+	/*
+	 * We use XKB extension because the keysym cache is built from the
+	 * XKB keyboard description, which also gives us the current set
+	 * of modifiers for a KeySym for SendEvent event injection type.
+	 */
+	xkbmaj = XkbMajorVersion;
+	xkbmin = XkbMinorVersion;
+	if (XkbLibraryVersion(&xkbmaj, &xkbmin) == False)
+		errx(1, "trouble with XKB extension; needed %d.%d got %d.%d",
+		    XkbMajorVersion, XkbMinorVersion, xkbmaj, xkbmin);
+	if (XkbQueryExtension(dpy, &xkb_op, &xkb_event, &xkb_error,
+	    &xkbmaj, &xkbmin) == False)
+		errx(1, "trouble with XKB extension");
 
-	while (XCheckMaskEvent(dpy, MappingNotify, &e) == True)
-		update_mapping(dpy, &e);
+	inj->dpy = dpy;
+	inj->backend = opt->backend;
+	inj->coalesce = opt->coalesce;
+	inj->priority = opt->priority;
+	inj->held = NULL;
+	inj->focus_resync = opt->focus_resync;
+	inj->backend->init(inj);
 
-	if (system(s) == -1)
-		err(1, "system");
+	keymap_init(&inj->keymap, dpy, xkb_event);
+	geometry_init(&inj->geom, dpy);
+	if (inj->backend != &sendevent_backend &&
+	    inj->backend != &uinput_backend)
+		pointer_init(inj);
+	layout_init(&inj->layout, opt->layout_wait);
+	replay_init(&inj->replay, opt->speed);
+	if (opt->preload != NULL) {
+		if ((preload = strdup(opt->preload)) == NULL)
+			err(1, "strdup");
+		layout_preload(inj, preload);
+		free(preload);
+	}
+	flush_init(&inj->flush, inj, opt->max_pending, opt->latency);
+}
 
+/*
+ * Injects events until the end of input, either reading them from rd
+ * or taking them from a ring filled by another thread.
+ */
+void
+injector_run(struct injector *inj, struct reader *rd, struct ring *ring,
+    struct metrics *mt)
+{
+	struct event ev[256];
+	struct pollfd pfd[4 + METRICS_CLIENTS];
+	struct timespec t0;
+	size_t i, j, n, ahead;
+	int done, nready, timeout, idle, held;
+
+	pfd[0].fd = ring != NULL ? ring_fd(ring) : rd->fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = ConnectionNumber(inj->dpy);
+	pfd[1].events = POLLIN;
+	pfd[2].fd = probe_fd(inj->probe);
+	pfd[2].events = POLLIN;
+	metrics_pollfd(mt, &pfd[3]);
+	i = n = ahead = 0;
+	done = 0;
 	do {
-		XNextEvent(dpy, &e);
-		switch (e.type) {
-		case MappingNotify:
-			update_mapping(dpy, &e);
-			break;
-		default:
-			break;
+		if (dump_latency && inj->latency != NULL) {
+			dump_latency = 0;
+			latency_dump(inj->latency);
+		}
+		xmotion_commit(inj);
+		if (XEventsQueued(inj->dpy, QueuedAlready) > 0)
+			xevents(inj);
+
+		/*
+		 * Requests are flushed only once there is no more input
+		 * immediately available, and not in the middle of a burst
+		 * whose rest the reader thread has yet to push. An event
+		 * that is not due yet is waited for here, with the rest of
+		 * its batch.
+		 */
+		timeout = layout_timeout(&inj->layout);
+		held = ring != NULL ? inj->held != NULL : i < n;
+		if (held && (timeout == -1 || inj->replay.wait < timeout))
+			timeout = inj->replay.wait;
+		idle = ring != NULL && held == 0 ? ring_idle(ring) : 1;
+		if ((inj->flush.pending > 0 && inj->flush.hold == 0) ||
+		    idle == 0)
+			timeout = 0;
+		if (ring == NULL)
+			pfd[0].fd = reader_room(rd) ? rd->fd : -1;
+		nready = poll(pfd, sizeof(pfd) / sizeof(pfd[0]), timeout);
+		if (nready == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		} else if (nready == 0 && idle) {
+			if (inj->flush.hold == 0)
+				flush_now(&inj->flush);
+			layout_check(&inj->layout);
+			if (held == 0)
+				continue;
+		}
+
+		if (pfd[1].revents & (POLLIN | POLLHUP))
+			xevents(inj);
+		if (pfd[2].revents & (POLLIN | POLLHUP))
+			probe_process(inj->probe);
+		if (mt != NULL && mt->fd != -1) {
+			metrics_serve(mt, &pfd[3]);
+			metrics_pollfd(mt, &pfd[3]);
+		}
+
+		if (ring != NULL) {
+			ring_woken(ring, pfd[0].revents);
+			done = drain(inj, ring) == 0;
+			continue;
+		}
+
+		if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+			reader_fill(rd);
+			probe_input(inj->probe);
+		}
+		for (;;) {
+			if (i == n) {
+				latency_mark(inj->latency, &t0);
+				i = 0;
+				if ((n = reader_parse(rd, ev,
+				    sizeof(ev) / sizeof(ev[0]))) == 0)
+					break;
+				latency_parsed(inj->latency, &t0, ev, n);
+				ahead = 0;
+				if (inj->priority)
+					for (j = 0; j < n; j++)
+						if (!IS_MOTION(ev[j].type))
+							ahead++;
+			}
+			for (; i < n; i++) {
+				inj->ahead = ahead;
+				if (!IS_MOTION(ev[i].type) && ahead > 0)
+					inj->ahead--;
+				if (dispatch(inj, &ev[i]) == 0)
+					break;
+				ahead = inj->ahead;
+			}
+			if (i < n)
+				break;
 		}
-	} while (e.type != MappingNotify);
+		/* Until the batch is done, its events point to the buffer. */
+		rd->pinned = i < n;
+		done = rd->eof && i == n;
+	} while (done == 0);
+}
+
+/*
+ * Injects whatever is still pending.
+ */
+void
+injector_finish(struct injector *inj)
+{
+	xtext_type(inj);
+	xmotion_commit(inj);
+	flush_now(&inj->flush);
+}
+
+void
+injector_stats(struct injector *inj)
+{
+	flush_stats(&inj->flush);
+	if (inj->motions > 0)
+		warnx("%llu motion events, %llu merged",
+		    inj->motions, inj->merged);
+	if (inj->priority)
+		warnx("priority lane folded %llu motion events, saving %llu "
+		    "requests or about %.3f ms", inj->folded, inj->saved,
+		    injector_saved(inj) * 1e3);
+	warnx("keysym cache built %llu times", inj->keymap.builds);
+	if (inj->keymap.remaps > 0)
+		warnx("%d scratch keys remapped %llu times, %llu evictions",
+		    inj->keymap.nscratch, inj->keymap.remaps,
+		    inj->keymap.evictions);
+	layout_stats(&inj->layout);
+	if (inj->focus.dpy != NULL)
+		warnx("focus queried %llu times, changed %llu times",
+		    inj->focus.queries, inj->focus.changes);
+	if (inj->tree.dpy != NULL)
+		warnx("window tree of %d windows updated %llu times, "
+		    "%llu queries", inj->tree.windows, inj->tree.updates,
+		    inj->tree.queries);
+	pointer_stats(&inj->ptr);
+}
+
+/*
+ * Injects an event. Returns 0 if it is not due yet; it is then to be
+ * given again once inj->replay.wait milliseconds have passed.
+ */
+static int
+dispatch(struct injector *inj, struct event *ev)
+{
+	struct timespec t0, t1;
+	int i, end;
+
+	if (ev->time >= 0 && replay_ready(&inj->replay, ev->time) == 0)
+		return 0;
+
+	if ((i = event_index(ev->type)) != -1)
+		inj->events[i]++;
+
+	/* A burst goes out in one flush, whatever the flush policy says. */
+	end = inj->flush.hold && ev->more == 0;
+	inj->flush.hold = ev->more;
 
 	/*
-	 * We need to wait for an event from the keymap change
-	 * before we can continue because we need to refresh
-	 * internal keysym to keycode mapping.
+	 * Priority lane: motion that is due while a key or button event
+	 * is queued behind it is folded into the pending motion, which
+	 * is injected as one request right before that event. Every
+	 * motion folded into another saves a request; when coalescing,
+	 * it is the same request that coalescing saves.
 	 */
+	if (IS_MOTION(ev->type) && inj->ahead > 0) {
+		if (inj->motion_pending)
+			inj->saved++;
+		inj->folded++;
+		if (ev->type == 'm')
+			xmotion(inj, ev->v1, ev->v2);
+		else
+			xabsolute(inj, ev->type, ev->v1, ev->v2, ev->v3);
+		if (end)
+			flush_now(&inj->flush);
+		return 1;
+	}
 
-	while (XCheckMaskEvent(dpy, MappingNotify, &e) == True)
-		update_mapping(dpy, &e);
+	latency_mark(inj->latency, &t0);
+	if (!IS_MOTION(ev->type))
+		xmotion_commit(inj);
+	/* The rest of a text whose last piece was dropped. */
+	if (ev->type != 'u')
+		xtext_type(inj);
+
+	switch (ev->type) {
+	case 'l':
+		latency_mark(inj->latency, &t1);
+		layout_switch(inj, ev->str);
+		latency_record(inj->latency, STAGE_REQUEST, 'l', &t1);
+		break;
+	case 'k':
+	case 'K':
+		xkey(inj, ev->type, ev->v1);
+		break;
+	case 'u':
+		xtext(inj, ev->str, ev->more);
+		break;
+	case 'm':
+		xmotion(inj, ev->v1, ev->v2);
+		break;
+	case 'a':
+	case 'A':
+		xabsolute(inj, ev->type, ev->v1, ev->v2, ev->v3);
+		break;
+	case 'b':
+	case 'B':
+		xbutton(inj, ev->type, ev->v1, ev->v2);
+		break;
+	case 'r':
+		xrelease(inj);
+		break;
+	}
+	if (end) {
+		xmotion_commit(inj);
+		flush_now(&inj->flush);
+	}
+
+	if (inj->latency != NULL) {
+		latency_record(inj->latency, STAGE_TOTAL, ev->type, &t0);
+		inj->latency->last = ev->type;
+	}
+	return 1;
+}
+
+static long
+getnum(const char *s, long min, long max, const char *what)
+{
+	char *end;
+	long n;
+
+	errno = 0;
+	n = strtol(s, &end, 10);
+	if (*s == '\0' || *end != '\0' || errno != 0 || n < min || n > max)
+		errx(1, "%s must be between %ld and %ld", what, min, max);
+	return n;
+}
+
+/*
+ * Parses a target given as "id=display[,device]". The display may be
+ * left empty for the default one.
+ */
+static void
+gettarget(char *s, struct target *t)
+{
+	char *p;
+
+	if ((p = strchr(s, '=')) == NULL)
+		errx(1, "target must be given as id=display[,device]");
+	*p++ = '\0';
+	t->id = getnum(s, 0, INT_MAX, "target id");
+	t->display = p;
+	t->device = NULL;
+	if ((p = strchr(p, ',')) != NULL) {
+		*p++ = '\0';
+		t->device = p;
+	}
+	if (*t->display == '\0')
+		t->display = NULL;
+}
+
+/*
+ * Replay speed multiplier; 0 replays as fast as possible.
+ */
+static double
+getspeed(const char *s)
+{
+	char *end;
+	double speed;
+
+	errno = 0;
+	speed = strtod(s, &end);
+	if (*s == '\0' || *end != '\0' || errno != 0 || speed < 0 ||
+	    speed > 1000)
+		errx(1, "speed must be between 0 and 1000");
+	return speed;
+}
+
+static const struct backend *
+getbackend(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++)
+		if (strcmp(name, backends[i]->name) == 0)
+			return backends[i];
+	errx(1, "unknown injection method '%s'", name);
+}
+
+/*
+ * Injects what the reader thread has queued, but at most a ring's worth
+ * at a time so that X events are not left waiting. An event that is not
+ * due yet is held, and its entry stays valid as ring_next() is not
+ * called again until it has been injected. Returns 0 once the reader is
+ * done and everything has been injected.
+ */
+static int
+drain(struct injector *inj, struct ring *rg)
+{
+	struct ring_entry *re;
+	int n;
+
+	for (n = 0; n < RING_SIZE; n++) {
+		if ((re = inj->held) == NULL && (re = ring_next(rg)) == NULL)
+			break;
+		if (inj->probe != NULL)
+			inj->probe->input = re->stamp;
+		if (inj->priority)
+			inj->ahead = ring_ahead(rg);
+		if (dispatch(inj, &re->ev) == 0) {
+			inj->held = re;
+			return -1;
+		}
+		inj->held = NULL;
+	}
+	return ring_eof(rg) ? 0 : -1;
+}
+
+/*
+ * Throughput and CPU use over the whole run, as measured by bench.sh.
+ */
+static void
+run_stats(const struct timespec *start, unsigned long long events)
+{
+	struct timespec now;
+	struct rusage ru;
+	double secs, user, sys;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (getrusage(RUSAGE_SELF, &ru) == -1)
+		err(1, "getrusage");
+	secs = (now.tv_sec - start->tv_sec) +
+	    (now.tv_nsec - start->tv_nsec) / 1e9;
+	user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+	sys = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+
+	warnx("%llu events in %.3f s, %.0f events/s; cpu %.3f s user, "
+	    "%.3f s system, %.3f us/event", events, secs,
+	    secs > 0 ? events / secs : 0, user, sys,
+	    events > 0 ? (user + sys) * 1e6 / events : 0);
+}
+
+/*
+ * The histograms are printed from the main loop; poll() is interrupted
+ * by the signal, so this happens even when no input is arriving.
+ */
+static void
+on_sigusr1(int sig)
+{
+	dump_latency = 1;
+}
+
+/*
+ * Handles events that arrived on the X connection while injecting.
+ */
+static void
+xevents(struct injector *inj)
+{
+	XEvent e;
+
+	while (XEventsQueued(inj->dpy, QueuedAfterReading) > 0) {
+		XNextEvent(inj->dpy, &e);
+		xevent(inj, &e);
+	}
+}
+
+void
+xevent(struct injector *inj, XEvent *e)
+{
+	XkbEvent *xe = (XkbEvent *) e;
+
+	switch (e->type) {
+	case MappingNotify:
+		update_mapping(inj, e);
+		break;
+	default:
+		if (e->type == inj->keymap.xkb_event &&
+		    xe->any.xkb_type == XkbStateNotify)
+			layout_locked(&inj->layout, xe->state.locked_group);
+		if (keymap_event(&inj->keymap, e) == 0 &&
+		    geometry_event(&inj->geom, e) == 0 &&
+		    wintree_event(&inj->tree, e) == 0 &&
+		    pointer_event(inj, e) == 0)
+			focus_event(&inj->focus, e);
+		break;
+	}
+}
+
+/*
+ * Adds to the events selected on a window instead of replacing them,
+ * so that different parts can select what they need on the root.
+ */
+void
+select_input(Display *dpy, Window win, long mask)
+{
+	XWindowAttributes wa;
+
+	if (XGetWindowAttributes(dpy, win, &wa) == 0)
+		return;
+	XSelectInput(dpy, win, wa.your_event_mask | mask);
+}
+
+/*
+ * Windows whose events we follow, or that we send events to, may be
+ * destroyed at any time. That is not a reason to exit.
+ */
+static int
+xerror(Display *dpy, XErrorEvent *e)
+{
+	if (e->error_code == BadWindow)
+		return 0;
+	return xerror_default(dpy, e);
 }
 
 static void
-update_mapping(Display *dpy, XEvent *e)
+update_mapping(struct injector *inj, XEvent *e)
 {
-	if (e->xmapping.request == MappingKeyboard)
+	if (e->xmapping.request == MappingKeyboard ||
+	    e->xmapping.request == MappingModifier) {
 		XRefreshKeyboardMapping(&e->xmapping);
+		if (keymap_own(&inj->keymap, &e->xmapping))
+			return;
+		if (keymap_loaded(&inj->keymap, &e->xmapping) == 0)
+			keymap_invalidate(&inj->keymap);
+		layout_mapped(&inj->layout);
+	}
 }
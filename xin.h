@@ -0,0 +1,698 @@
+/*
+ * xin - X11 forwarded input receiver
+ * Copyright (c) 2020 Tommi Leino <namhas@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef XIN_H
+#define XIN_H
+
+#include <X11/Xlib.h>
+#include <X11/Xlib-xcb.h>
+#include <X11/XKBlib.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * Longest accepted input line including the newline. It used to be the
+ * 64 byte fgets() buffer, but burst lines need much more.
+ */
+#define MAXLINE 1024
+
+/*
+ * Longest layout name or piece of text including the terminating NUL.
+ * These are copied into every ring entry, so this is kept as short as
+ * the lines used to be.
+ */
+#define MAXSTR 64
+
+/*
+ * Longest text of a 'u' line or record. A longer text than MAXSTR
+ * allows is split into a burst of pieces.
+ */
+#define MAXTEXT MAXLINE
+
+/*
+ * Most motion deltas or keysyms in one burst line or record. A keysym
+ * becomes both a press and a release.
+ */
+#define BURST_MAX 128
+
+/*
+ * Size of the stdin read buffer. Many lines are read with one read()
+ * and tokenized directly from here.
+ */
+#define READBUFSZ 65536
+
+/*
+ * Number of XKB keyboard groups, i.e. layouts in one keymap.
+ */
+#define MAXGROUPS 4
+
+/*
+ * XInput 2 version asked for. Raw events are delivered while another
+ * client has grabbed the device only from 2.1 on; an older server
+ * answers with its own version. The same version must be asked for on
+ * every call of a connection.
+ */
+#define XI_MAJOR 2
+#define XI_MINOR 2
+
+/*
+ * Most unused keycodes taken for keysyms that no key produces.
+ */
+#define SCRATCH_KEYS 16
+
+/*
+ * Most scratch key remaps whose MappingNotify is waited for. An older
+ * one is forgotten, and its MappingNotify taken for a foreign change.
+ */
+#define REMAPS_MAX 16
+
+/*
+ * Latency histograms have 2^HIST_SUBBITS linear buckets per power of
+ * two and cover values up to 2^HIST_MAXBITS nanoseconds.
+ */
+#define HIST_SUBBITS 4
+#define HIST_MAXBITS 40
+#define HIST_BUCKETS ((HIST_MAXBITS - HIST_SUBBITS + 1) << HIST_SUBBITS)
+
+/*
+ * Event types, in the order their counters and histograms are kept.
+ */
+#define EVENT_TYPES	"kKbBmlaAu"
+#define NTYPES		((int) sizeof(EVENT_TYPES) - 1)
+
+/*
+ * Relative and absolute motion all move the same pointer position, and
+ * are coalesced and folded alike.
+ */
+#define IS_MOTION(type)	((type) == 'm' || (type) == 'a' || (type) == 'A')
+
+/*
+ * Absolute positions of 'A' are given in 0..NORM_MAX over the screen or
+ * the monitor.
+ */
+#define NORM_MAX	65535
+
+struct event {
+	char		 type;		/* one of EVENT_TYPES, or 'r' */
+	int		 v1;
+	int		 v2;
+	int		 v3;		/* 'a' screen, 'A' monitor, or -1 */
+	char		*str;		/* 'l' layout or 'u' text, points to
+					   reader buffer */
+	long long	 time;		/* usec in stream time, or -1 */
+	int		 target;	/* routing id, 0 if untagged */
+	int		 more;		/* more of the same burst follow */
+};
+
+enum reader_mode {
+	READER_AUTO,
+	READER_TEXT,
+	READER_BINARY
+};
+
+struct reader {
+	int			 fd;
+	enum reader_mode	 mode;
+	int			 sniffed;
+	char			 buf[READBUFSZ];
+	size_t			 start;
+	size_t			 end;
+	int			 skip_truncated;
+	size_t			 skip;
+	int			 eof;
+	int			 pinned;	/* events point to buf */
+	int			 timed;		/* binary only */
+	long long		 time;
+	int			 target;	/* binary only */
+	struct event		 burst[2 * BURST_MAX];
+	size_t			 nburst;
+	size_t			 burst_next;
+	char			 text[2 * MAXTEXT];	/* its pieces */
+	size_t			 ntext;
+
+	unsigned long long	 reads;
+	unsigned long long	 bytes;
+	unsigned long long	 lines;
+	unsigned long long	 events;
+	unsigned long long	 bursts;
+	unsigned long long	 errors;
+	unsigned long long	 truncated;
+	struct timespec		 parse_time;
+};
+
+/*
+ * The reader's counters as seen from another thread.
+ */
+struct reader_counts {
+	unsigned long long	 reads;
+	unsigned long long	 bytes;
+	unsigned long long	 lines;
+	unsigned long long	 bursts;
+	unsigned long long	 errors;
+	unsigned long long	 truncated;
+	unsigned long		 buffered;	/* bytes not yet parsed */
+};
+
+struct injector;
+struct ring;
+struct metrics;
+
+struct keyent {
+	KeySym			 keysym;
+	KeyCode			 keycode;
+	unsigned char		 mods;
+};
+
+struct scratch {
+	KeySym			 keysym;	/* NoSymbol if free */
+	unsigned long long	 used;
+};
+
+struct keymap {
+	Display			*dpy;
+	struct keyent		*tab[MAXGROUPS];
+	int			 ngroups;
+	int			 group;
+	int			 xkb_event;
+	size_t			 mask;
+	int			 stale;
+	unsigned long		 serial;	/* of the last load */
+	unsigned long long	 builds;
+
+	struct scratch		 scratch[SCRATCH_KEYS];
+	int			 first;		/* first scratch keycode */
+	int			 nscratch;
+	int			 lo;		/* scratch keys to remap */
+	int			 hi;
+	unsigned long		 remap[REMAPS_MAX];	/* serials */
+	int			 oldest;
+	int			 inflight;	/* remaps not yet notified */
+	unsigned long long	 clock;
+	unsigned long long	 batch;		/* first use pinned */
+	unsigned long long	 remaps;
+	unsigned long long	 evictions;
+};
+
+struct monitor {
+	int			 x;
+	int			 y;
+	int			 w;
+	int			 h;
+};
+
+struct geometry {
+	Display			*dpy;
+	int			 have_randr;
+	int			 rr_event;
+	int			 rr_error;
+	struct monitor		*mon;
+	int			 nmon;
+	int			 cur;		/* where the pointer was */
+	int			 stale;
+	unsigned long long	 refreshes;
+};
+
+struct focus {
+	Display				*dpy;
+	xcb_connection_t		*conn;
+	Window				 root;
+	Window				 win;
+	Atom				 net_active;
+	long				 mask;		/* kept on the focus */
+	long				 resync;	/* msec */
+	int				 pending;
+	xcb_get_input_focus_cookie_t	 cookie;
+	struct timespec			 last;
+	unsigned long long		 queries;
+	unsigned long long		 changes;
+};
+
+/*
+ * The real pointer position, as followed from XI2 raw motion.
+ */
+struct pointer {
+	Display				*dpy;
+	xcb_connection_t		*conn;
+	int				 opcode;
+	int				 own;		/* our device, or -1 */
+	int				 pending;
+	int				 again;
+	int				 stale;		/* moved absolutely since */
+	xcb_query_pointer_cookie_t	 cookie;
+	int				 sx;		/* last sent */
+	int				 sy;
+	int				 qx;		/* last sent at query */
+	int				 qy;
+	unsigned long long		 foreign;
+	unsigned long long		 queries;
+	unsigned long long		 drifts;
+};
+
+/*
+ * A window in the window tree cache of the SendEvent method. Children
+ * are kept in stacking order; x and y are those of the outer corner
+ * relative to the inside of the parent, like in ConfigureNotify.
+ */
+struct winnode {
+	Window			 id;
+	struct winnode		*parent;
+	struct winnode		*top;		/* topmost child */
+	struct winnode		*bottom;
+	struct winnode		*above;		/* next sibling upwards */
+	struct winnode		*below;
+	struct winnode		*hnext;
+	int			 x;
+	int			 y;
+	int			 w;
+	int			 h;
+	int			 bw;
+	int			 mapped;
+	int			 placed;	/* geometry known */
+	int			 map_known;
+};
+
+struct winquery {
+	int			 kind;
+	Window			 win;
+	unsigned int		 seq;
+};
+
+struct wintree {
+	Display			*dpy;
+	xcb_connection_t	*conn;
+	struct focus		*focus;
+	struct winnode		*root;
+	struct winnode		**hash;
+	struct winquery		*q;		/* replies still to come */
+	size_t			 qhead;
+	size_t			 qlen;
+	size_t			 qsize;
+	Window			 under;		/* pointer window last time */
+	Window			 grab;		/* while a button is down */
+	int			 windows;
+	unsigned long long	 updates;
+	unsigned long long	 queries;
+};
+
+struct layout {
+	char			 name[64];
+	long			 timeout;	/* msec */
+	int			 pending;
+	int			 lock;		/* group pending, or -1 */
+	struct timespec		 start;
+	char			 preload[MAXGROUPS][16];
+	int			 npreload;
+	int			 preloaded;
+	unsigned long long	 switches;
+	unsigned long long	 locks;
+	unsigned long long	 fallbacks;
+	unsigned long long	 timeouts;
+	unsigned long long	 mapped;
+	double			 total_ms;
+	double			 max_ms;
+};
+
+struct replay {
+	double			 speed;		/* 0 for no pacing */
+	int			 started;
+	struct timespec		 base;
+	long long		 t0;
+	unsigned long long	 events;
+	unsigned long long	 late;
+	double			 jitter_sum;	/* usec */
+	double			 jitter_max;
+	int			 wait;		/* msec until the held event */
+};
+
+enum stage {
+	STAGE_PARSE,
+	STAGE_LOOKUP,
+	STAGE_REQUEST,
+	STAGE_FLUSH,
+	STAGE_TOTAL,
+	NSTAGES
+};
+
+struct hist {
+	unsigned long long	 count[HIST_BUCKETS];
+	unsigned long long	 total;
+	unsigned long long	 max;
+};
+
+struct latency {
+	struct hist		 h[NSTAGES][NTYPES];
+	char			 last;		/* type dispatched last */
+};
+
+struct flush {
+	struct injector		*inj;
+	int			 max_pending;
+	long			 latency;	/* microseconds */
+	int			 pending;
+	int			 hold;		/* inside a burst */
+	struct timespec		 oldest;
+
+	unsigned long long	 flushes;
+	unsigned long long	 requests;
+};
+
+/*
+ * An injection method. Keys are given as resolved keycodes along with
+ * the modifiers bound to their keysym, and motion is always absolute.
+ */
+struct backend {
+	const char	*name;
+	void		(*init)(struct injector *);
+	void		(*key)(struct injector *, KeyCode, unsigned int, Bool);
+	void		(*button)(struct injector *, unsigned int, Bool);
+	void		(*motion)(struct injector *, int, int, int);
+	void		(*pointer)(struct injector *, int *, int *);
+	void		(*flush)(struct injector *);
+};
+
+struct injector {
+	Display			*dpy;
+	const struct backend	*backend;
+	void			*priv;		/* backend state */
+	struct flush		 flush;
+	struct keymap		 keymap;
+	struct geometry		 geom;
+	struct layout		 layout;
+	struct replay		 replay;
+	struct latency		*latency;	/* NULL unless -H */
+	struct probe		*probe;		/* NULL unless -P */
+
+	int			 have_pointer;
+	int			 x;
+	int			 y;
+	int			 screen;
+	struct pointer		 ptr;
+	unsigned int		 modifiers;	/* SendEvent only */
+	struct focus		 focus;		/* SendEvent only */
+	struct wintree		 tree;		/* SendEvent only */
+	long			 focus_resync;
+
+	int			 coalesce;
+	int			 motion_pending;
+	unsigned long long	 motions;
+	unsigned long long	 merged;
+	unsigned long long	 events[NTYPES];
+
+	int			 priority;
+	unsigned long		 ahead;		/* discrete events queued */
+	unsigned long long	 folded;
+	unsigned long long	 saved;		/* motion requests */
+	unsigned long long	 motion_ns;
+	unsigned long long	 motion_requests;
+
+	struct ring_entry	*held;		/* not due yet, with -T */
+
+	unsigned char		 keys[32];	/* keycodes held down */
+	unsigned int		 buttons;
+	KeySym			 text[MAXTEXT];	/* of a split 'u' text */
+	int			 ntext;
+};
+
+/*
+ * Settings for setting up an injector, the same for every display.
+ */
+struct options {
+	const struct backend	*backend;
+	int			 max_pending;
+	long			 latency;	/* usec */
+	int			 coalesce;
+	int			 priority;
+	long			 focus_resync;	/* msec */
+	long			 layout_wait;	/* msec */
+	const char		*preload;
+	double			 speed;
+};
+
+extern const struct backend xtest_backend;
+extern const struct backend sendevent_backend;
+extern const struct backend xcb_backend;
+extern const struct backend uinput_backend;
+
+void	 injector_open(struct injector *, const char *,
+	    const struct options *);
+void	 injector_run(struct injector *, struct reader *, struct ring *,
+	    struct metrics *);
+void	 injector_finish(struct injector *);
+void	 injector_stats(struct injector *);
+double	 injector_saved(struct injector *);
+void	 xmotion_commit(struct injector *);
+void	 xpointer(struct injector *);
+void	 xevent(struct injector *, XEvent *);
+void	 select_input(Display *, Window, long);
+
+void	 reader_init(struct reader *, int, enum reader_mode);
+int	 reader_fill(struct reader *);
+int	 reader_room(struct reader *);
+size_t	 reader_parse(struct reader *, struct event *, size_t);
+void	 reader_burst_add(struct reader *, const struct event *, char, int,
+	    int);
+size_t	 reader_burst_take(struct reader *, struct event *, size_t);
+void	 reader_burst_text(struct reader *, const struct event *,
+	    const char *, size_t);
+void	 reader_stats(struct reader *);
+void	 reader_counts(struct reader *, struct reader_counts *);
+int	 event_index(char);
+
+void	 keymap_init(struct keymap *, Display *, int);
+int	 keymap_event(struct keymap *, XEvent *);
+void	 keymap_set_group(struct keymap *, int);
+void	 keymap_invalidate(struct keymap *);
+KeyCode	 keymap_lookup(struct keymap *, KeySym, unsigned int *);
+void	 keymap_pin(struct keymap *);
+KeyCode	 keymap_scratch(struct keymap *, KeySym, const unsigned char *);
+int	 keymap_remap(struct keymap *);
+int	 keymap_own(struct keymap *, XMappingEvent *);
+void	 keymap_load(struct keymap *, XkbDescPtr, unsigned long);
+int	 keymap_loaded(struct keymap *, XMappingEvent *);
+
+void	 geometry_init(struct geometry *, Display *);
+int	 geometry_event(struct geometry *, XEvent *);
+int	 geometry_monitor(struct geometry *, int, int);
+void	 geometry_clamp(struct geometry *, int *, int *);
+struct monitor *geometry_get(struct geometry *, int);
+
+void	 focus_init(struct focus *, Display *, long, long);
+int	 focus_event(struct focus *, XEvent *);
+Window	 focus_window(struct focus *);
+
+void	 pointer_init(struct injector *);
+void	 pointer_devices(struct pointer *);
+int	 pointer_event(struct injector *, XEvent *);
+void	 pointer_sync(struct injector *);
+void	 pointer_warped(struct pointer *);
+void	 pointer_stats(struct pointer *);
+
+void	 wintree_init(struct wintree *, Display *, struct focus *);
+int	 wintree_event(struct wintree *, XEvent *);
+Window	 wintree_find(struct wintree *, int, int, int *, int *);
+int	 wintree_origin(struct wintree *, Window, int *, int *);
+
+void	 layout_init(struct layout *, long);
+void	 layout_preload(struct injector *, char *);
+void	 layout_switch(struct injector *, const char *);
+void	 layout_mapped(struct layout *);
+void	 layout_locked(struct layout *, int);
+int	 layout_timeout(struct layout *);
+void	 layout_check(struct layout *);
+void	 layout_stats(struct layout *);
+
+void	 replay_init(struct replay *, double);
+int	 replay_ready(struct replay *, long long);
+void	 replay_stats(struct replay *, const char *);
+
+struct latency	*latency_new(void);
+void	 latency_mark(struct latency *, struct timespec *);
+void	 latency_record(struct latency *, int, char, const struct timespec *);
+void	 latency_parsed(struct latency *, const struct timespec *,
+	    struct event *, size_t);
+void	 latency_merge(struct latency *, struct latency *);
+void	 latency_dump(struct latency *);
+void	 hist_add(struct hist *, unsigned long long);
+unsigned long long hist_percentile(struct hist *, double);
+
+struct probe	*probe_new(Display *);
+int	 probe_fd(struct probe *);
+void	 probe_input(struct probe *);
+void	 probe_sent(struct probe *, int, int);
+void	 probe_process(struct probe *);
+void	 probe_finish(struct probe *);
+void	 probe_stats(struct probe *);
+
+/*
+ * Injected events waiting to be seen by the latency probe.
+ */
+#define PROBE_QUEUE 4096
+
+struct probe_entry {
+	unsigned char		 type;
+	unsigned char		 detail;
+	struct timespec		 sent;
+};
+
+struct probe {
+	Display			*dpy;
+	Display			*rdpy;		/* recording connection */
+	unsigned long		 ctx;		/* XRecordContext */
+	struct timespec		 input;
+	struct probe_entry	 queue[PROBE_QUEUE];
+	int			 head;
+	int			 len;
+	struct hist		 hist;
+
+	unsigned long long	 sent;
+	unsigned long long	 lost;
+	unsigned long long	 foreign;
+	unsigned long long	 overflows;
+};
+
+/*
+ * Size of the event ring between the reader thread and the injector,
+ * and how many entries the injector takes before giving them back.
+ */
+#define RING_SIZE	4096
+#define RING_BATCH	64
+
+struct ring_entry {
+	struct event		 ev;
+	struct timespec		 stamp;		/* when its input was read */
+	char			 str[MAXSTR];
+};
+
+struct ring {
+	struct ring_entry	*buf;
+	struct reader		*rd;
+	struct latency		*latency;	/* the reader thread's */
+	struct latency		*into;		/* the injector's */
+	pthread_t		 thread;
+	int			 wake[2];	/* to the injector */
+	int			 space[2];	/* to the reader */
+	int			 eof;
+
+	/* Written by the reader thread */
+	unsigned long		 tail __attribute__((aligned(64)));
+	unsigned long		 discrete;	/* pushed other than motion */
+	int			 waiting;
+	unsigned long long	 stalls;
+	unsigned long long	 stall_ns;
+	struct reader_counts	 counts;	/* as of its last round */
+
+	/* Written by the injector */
+	unsigned long		 head __attribute__((aligned(64)));
+	int			 sleeping;
+	unsigned long		 next;
+	unsigned long		 avail;
+	unsigned long		 taken;		/* discrete taken */
+	unsigned long		 max_depth;
+};
+
+#define METRICS_CLIENTS 4
+
+struct metrics {
+	int			 fd;
+	int			 client[METRICS_CLIENTS];
+	struct reader		*rd;
+	struct injector		*inj;
+	struct ring		*ring;		/* NULL unless -T */
+	unsigned long long	 scrapes;
+	unsigned long long	 dropped;
+};
+
+/*
+ * Events are parsed and handed to the workers this many at a time.
+ */
+#define FANOUT_BATCH 256
+
+/*
+ * A display given with -d, or a target id mapped to a display and an
+ * optional XI2 master device with -t.
+ */
+struct target {
+	int			 id;		/* -1 with -d */
+	const char		*display;	/* NULL for $DISPLAY */
+	const char		*device;	/* NULL for the default */
+};
+
+/*
+ * An injector of its own for one of several displays or targets.
+ */
+struct worker {
+	char			 name[64];
+	int			 target;
+	struct injector		 inj;
+	struct ring		 ring;
+	pthread_t		 thread;
+	int			 lagging;
+	unsigned long long	 dropped;
+	unsigned long long	 lags;
+	struct event		 batch[FANOUT_BATCH];
+	size_t			 nbatch;
+};
+
+struct fanout {
+	struct worker		*w;
+	int			 n;
+	int			 route;		/* by target instead of all */
+	int			 last;		/* worker of the last target */
+	long			 lag;		/* msec */
+	unsigned long long	 unrouted;
+};
+
+void	 ring_init(struct ring *);
+void	 ring_start(struct ring *, struct reader *, struct latency *);
+void	 ring_join(struct ring *);
+void	 thread_start(pthread_t *, void *(*)(void *), void *);
+size_t	 ring_push(struct ring *, struct event *, size_t,
+	    const struct timespec *, long);
+void	 ring_close(struct ring *);
+int	 ring_drained(struct ring *);
+int	 ring_fd(struct ring *);
+struct ring_entry *ring_next(struct ring *);
+int	 ring_idle(struct ring *);
+void	 ring_woken(struct ring *, short);
+int	 ring_eof(struct ring *);
+unsigned long ring_depth(struct ring *);
+unsigned long ring_ahead(struct ring *);
+void	 ring_counts(struct ring *, struct reader_counts *);
+void	 ring_stats(struct ring *);
+
+void	 fanout_init(struct fanout *, struct target *, int, int, long,
+	    const struct options *);
+void	 fanout_run(struct fanout *, struct reader *);
+void	 fanout_stats(struct fanout *);
+void	 fanout_replay_stats(struct fanout *);
+
+void	 metrics_init(struct metrics *, const char *, struct reader *,
+	    struct injector *);
+void	 metrics_pollfd(struct metrics *, struct pollfd *);
+void	 metrics_serve(struct metrics *, struct pollfd *);
+
+void	 flush_init(struct flush *, struct injector *, int, long);
+void	 flush_request(struct flush *);
+void	 flush_now(struct flush *);
+void	 flush_stats(struct flush *);
+
+int	 wire_sniff(struct reader *);
+size_t	 wire_parse(struct reader *, struct event *, size_t);
+
+#endif
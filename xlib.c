@@ -0,0 +1,286 @@
+/*
+ * xin - X11 forwarded input receiver
+ * Copyright (c) 2020 Tommi Leino <namhas@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Xlib injection methods: XTEST and SendEvent.
+ *
+ * SendEvent keys go to the input focus, and buttons and motion to the
+ * window under the pointer as found from the window tree cache, or
+ * while a button is held down, to the window it was pressed in, as the
+ * server would do with its implicit grab. Buttons and motion propagate
+ * up from there like real ones, but keep coordinates relative to the
+ * window they were sent to. When the pointer moves to another window,
+ * that window gets EnterNotify and the previous one LeaveNotify.
+ */
+
+#include "xin.h"
+
+#include <X11/extensions/XTest.h>
+#include <X11/XKBlib.h>
+#include <err.h>
+
+static void	xtest_init(struct injector *);
+static void	xtest_key(struct injector *, KeyCode, unsigned int, Bool);
+static void	xtest_button(struct injector *, unsigned int, Bool);
+static void	xtest_motion(struct injector *, int, int, int);
+static void	xlib_pointer(struct injector *, int *, int *);
+static void	xlib_flush(struct injector *);
+static void	sendevent_init(struct injector *);
+static void	sendevent_key(struct injector *, KeyCode, unsigned int, Bool);
+static void	sendevent_button(struct injector *, unsigned int, Bool);
+static void	sendevent_motion(struct injector *, int, int, int);
+static Window	sendevent_target(struct injector *, int *, int *);
+static void	sendevent_crossing(struct injector *, int, Window, int, int);
+static unsigned int sendevent_state(struct injector *, unsigned int);
+
+const struct backend xtest_backend = {
+	"xtest",
+	xtest_init,
+	xtest_key,
+	xtest_button,
+	xtest_motion,
+	xlib_pointer,
+	xlib_flush
+};
+
+const struct backend sendevent_backend = {
+	"sendevent",
+	sendevent_init,
+	sendevent_key,
+	sendevent_button,
+	sendevent_motion,
+	xlib_pointer,
+	xlib_flush
+};
+
+static void
+xtest_init(struct injector *inj)
+{
+	int xtst_event, xtst_error, xtst_majv, xtst_minv;
+
+	if (XTestQueryExtension(inj->dpy, &xtst_event, &xtst_error,
+	    &xtst_majv, &xtst_minv) == False)
+		errx(1, "XTEST not available; try -s");
+}
+
+static void
+xtest_key(struct injector *inj, KeyCode keycode, unsigned int mods,
+    Bool is_press)
+{
+	XTestFakeKeyEvent(inj->dpy, keycode, is_press, 0);
+}
+
+static void
+xtest_button(struct injector *inj, unsigned int button, Bool is_press)
+{
+	XTestFakeButtonEvent(inj->dpy, button, is_press, 0);
+}
+
+static void
+xtest_motion(struct injector *inj, int screen, int x, int y)
+{
+	XTestFakeMotionEvent(inj->dpy, screen, x, y, 0);
+}
+
+static void
+xlib_pointer(struct injector *inj, int *x, int *y)
+{
+	Window root, child;
+	int wx, wy;
+	unsigned int state;
+
+	XQueryPointer(inj->dpy, RootWindow(inj->dpy, 0), &root, &child,
+	    x, y, &wx, &wy, &state);
+}
+
+static void
+xlib_flush(struct injector *inj)
+{
+	XFlush(inj->dpy);
+}
+
+static void
+sendevent_init(struct injector *inj)
+{
+	inj->modifiers = 0;
+	wintree_init(&inj->tree, inj->dpy, &inj->focus);
+	focus_init(&inj->focus, inj->dpy, inj->focus_resync,
+	    SubstructureNotifyMask);
+}
+
+static void
+sendevent_key(struct injector *inj, KeyCode keycode, unsigned int mods,
+    Bool is_press)
+{
+	Window focus;
+	XEvent e = { 0 };
+
+	focus = focus_window(&inj->focus);
+
+	e.type = (is_press == True) ? KeyPress : KeyRelease;
+	e.xkey.keycode = keycode;
+	e.xkey.window = focus;
+	e.xkey.subwindow = focus;
+	if (is_press)
+		inj->modifiers |= mods;
+	else
+		inj->modifiers &= ~mods;
+	e.xkey.state = inj->modifiers;
+	e.xkey.type = (is_press == True) ? KeyPress : KeyRelease;
+	e.xkey.time = CurrentTime;
+	XSendEvent(inj->dpy, focus, False,
+	    (is_press == True) ? KeyPressMask : KeyReleaseMask, &e);
+}
+
+static void
+sendevent_button(struct injector *inj, unsigned int button, Bool is_press)
+{
+	XEvent e = { 0 };
+	Window win;
+	int x, y;
+
+	win = sendevent_target(inj, &x, &y);
+
+	e.xbutton.type = (is_press == True) ? ButtonPress : ButtonRelease;
+	e.xbutton.window = win;
+	e.xbutton.root = RootWindow(inj->dpy, 0);
+	e.xbutton.subwindow = None;
+	e.xbutton.time = CurrentTime;
+	e.xbutton.x = x;
+	e.xbutton.y = y;
+	e.xbutton.x_root = inj->x;
+	e.xbutton.y_root = inj->y;
+	e.xbutton.state = sendevent_state(inj, button);
+	e.xbutton.button = button;
+	e.xbutton.same_screen = True;
+	XSendEvent(inj->dpy, win, True,
+	    (is_press == True) ? ButtonPressMask : ButtonReleaseMask, &e);
+
+	/* The buttons held down have already been updated. */
+	if (is_press && inj->buttons == 1U << button)
+		inj->tree.grab = win;
+	else if (is_press == False && inj->buttons == 0)
+		inj->tree.grab = None;
+}
+
+static void
+sendevent_motion(struct injector *inj, int screen, int x_root, int y_root)
+{
+	XEvent e = { 0 };
+	Window win;
+	long mask;
+	int x, y, i;
+
+	win = sendevent_target(inj, &x, &y);
+	if (inj->tree.grab == None && win != inj->tree.under) {
+		if (inj->tree.under != None)
+			sendevent_crossing(inj, LeaveNotify, inj->tree.under,
+			    x_root, y_root);
+		sendevent_crossing(inj, EnterNotify, win, x_root, y_root);
+		inj->tree.under = win;
+	}
+
+	mask = PointerMotionMask;
+	if (inj->buttons != 0) {
+		mask |= ButtonMotionMask;
+		for (i = 1; i <= 5; i++)
+			if (inj->buttons & (1U << i))
+				mask |= Button1MotionMask << (i - 1);
+	}
+
+	e.xmotion.type = MotionNotify;
+	e.xmotion.window = win;
+	e.xmotion.root = RootWindow(inj->dpy, screen);
+	e.xmotion.subwindow = None;
+	e.xmotion.time = CurrentTime;
+	e.xmotion.x = x;
+	e.xmotion.y = y;
+	e.xmotion.x_root = x_root;
+	e.xmotion.y_root = y_root;
+	e.xmotion.state = sendevent_state(inj, 0);
+	e.xmotion.is_hint = NotifyNormal;
+	e.xmotion.same_screen = True;
+	XSendEvent(inj->dpy, win, True, mask, &e);
+}
+
+/*
+ * Returns the window pointer events go to, and the pointer position
+ * relative to it.
+ */
+static Window
+sendevent_target(struct injector *inj, int *x, int *y)
+{
+	int ox, oy;
+
+	/* A click before any motion goes where the pointer really is. */
+	xpointer(inj);
+	if (inj->tree.grab != None &&
+	    wintree_origin(&inj->tree, inj->tree.grab, &ox, &oy)) {
+		*x = inj->x - ox;
+		*y = inj->y - oy;
+		return inj->tree.grab;
+	}
+	inj->tree.grab = None;
+	return wintree_find(&inj->tree, inj->x, inj->y, x, y);
+}
+
+static void
+sendevent_crossing(struct injector *inj, int type, Window win, int x_root,
+    int y_root)
+{
+	XEvent e = { 0 };
+	int ox, oy;
+
+	if (wintree_origin(&inj->tree, win, &ox, &oy) == 0)
+		return;
+	e.xcrossing.type = type;
+	e.xcrossing.window = win;
+	e.xcrossing.root = RootWindow(inj->dpy, 0);
+	e.xcrossing.subwindow = None;
+	e.xcrossing.time = CurrentTime;
+	e.xcrossing.x = x_root - ox;
+	e.xcrossing.y = y_root - oy;
+	e.xcrossing.x_root = x_root;
+	e.xcrossing.y_root = y_root;
+	e.xcrossing.mode = NotifyNormal;
+	e.xcrossing.detail = NotifyNonlinear;
+	e.xcrossing.same_screen = True;
+	e.xcrossing.focus = (win == inj->focus.win);
+	e.xcrossing.state = sendevent_state(inj, 0);
+	XSendEvent(inj->dpy, win, False,
+	    type == EnterNotify ? EnterWindowMask : LeaveWindowMask, &e);
+}
+
+/*
+ * The modifier and button state before the event; the given button,
+ * if any, is the one it presses or releases.
+ */
+static unsigned int
+sendevent_state(struct injector *inj, unsigned int button)
+{
+	unsigned int state, held;
+	int i;
+
+	held = inj->buttons;
+	if (button > 0 && button < 32)
+		held ^= 1U << button;
+	state = inj->modifiers;
+	for (i = 1; i <= 5; i++)
+		if (held & (1U << i))
+			state |= Button1Mask << (i - 1);
+	return state;
+}